@@ -32,6 +32,40 @@ void bitmap_set(bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Sets a run of bits in bitmap, whole bytes at a time where it can
+/// \param bitmap The bitmap
+/// \param first The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t first, const size_t count);
+
+///
+/// Clears a run of bits in bitmap, whole bytes at a time where it can
+/// \param bitmap The bitmap
+/// \param first The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t first, const size_t count);
+
+///
+/// Checks that every bit in a run is set, a 64-bit word at a time
+/// \param bitmap The bitmap
+/// \param first The first bit to check
+/// \param count The number of bits to check
+/// \return true if they're all set, false if any aren't or on error (empty or out of range)
+///
+bool bitmap_range_all_set(const bitmap_t *const bitmap, const size_t first, const size_t count);
+
+///
+/// Counts the bits set in a run, a 64-bit word at a time
+/// \param bitmap The bitmap
+/// \param first The first bit to count
+/// \param count The number of bits to count
+/// \return the number of bits set in the run, 0 on error (empty or out of range)
+///
+size_t bitmap_range_count(const bitmap_t *const bitmap, const size_t first, const size_t count);
+
 ///
 /// Returns bit in bitmap
 /// \param bitmap The bitmap
@@ -67,6 +101,61 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Sets a bit, atomically, and says whether it was already set
+///  Safe to call from many threads at once (and alongside bitmap_ffz_and_set_atomic) on the same bitmap,
+///  overlays included, with a compare-and-swap on the 64-bit word the bit is in (its byte for unaligned overlays)
+///  Anything that clears bits still needs the caller to keep other threads out while it runs
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return The bit's previous value, so false means this call claimed it. true on error (out of range)
+///
+bool bitmap_test_and_set_atomic(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Finds the first zero and sets it, atomically
+///  Same thread safety as bitmap_test_and_set_atomic: concurrent calls never hand out the same bit
+/// \param bitmap The bitmap
+/// \return The bit claimed, SIZE_MAX on error/full
+///
+size_t bitmap_ffz_and_set_atomic(bitmap_t *const bitmap);
+
+///
+/// Find next zero, starting at (and including) the given bit
+/// \param bitmap The bitmap
+/// \param from The bit to start searching at
+/// \return The first zero bit address at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Find next set, starting at (and including) the given bit
+///  Skips clear words whole, so walking a sparse bitmap with it costs about a step per set bit
+/// \param bitmap The bitmap
+/// \param from The bit to start searching at
+/// \return The first one bit address at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Find a run of zeroes, starting at (and including) the given bit
+/// \param bitmap The bitmap
+/// \param len The number of zero bits wanted in a row
+/// \param from The bit to start searching at
+/// \return The first bit of the first run of at least len zeroes at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t len, const size_t from);
+
+///
+/// Find a run of zeroes near a hint, wrapping around to the start if there isn't one past it
+///  One pass over the words, carrying runs across word boundaries, no bit-at-a-time scanning
+/// \param bitmap The bitmap
+/// \param run_len The number of zero bits wanted in a row
+/// \param start_hint The bit to start searching at (out of range hints start at 0)
+/// \return The first bit of a run of at least run_len zeroes, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t run_len, const size_t start_hint);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -74,8 +163,9 @@ size_t bitmap_ffz(const bitmap_t *const bitmap);
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
 ///
-/// For each loop for all set bits
+/// For each loop for all set bits, in order
 ///  (Arguments passed to func are saved across calls)
+///  Bits are read a 64-bit word at a time, so changes func makes to the word it's in may not be seen
 /// \param bitmap The bitmap
 /// \param func The function to apply (first parameter will be size_t with the bit number)
 /// \param args A generic pointer to pass to the called function
@@ -134,6 +224,8 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  The bitmap keeps a summary of the data for bitmap_ffz, so changes
+///  made to the memory directly (not through this bitmap) won't be seen by it
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
 /// \return New bitmap pointer, NULL on error
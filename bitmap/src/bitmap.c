@@ -4,11 +4,25 @@
 // (also, make sure that ALL is as wide as ll of the flags)
 typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
 
+// Enough levels to summarize SIZE_MAX bits (64^10 > 2^58 words)
+#define SUMMARY_LEVEL_MAX 10
+
 struct bitmap {
     unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
-    uint8_t *data;
+    // Stored as 64-bit words, each in little-endian byte order whatever the host, so the bytes are laid out
+    // just as they always were (bit n in byte n >> 3) and export/import/overlay see no difference
+    // Our own storage is padded out to whole words. Overlays are the caller's bytes, which can stop part way
+    // into the last word, or not be word aligned at all (then words is NULL and everything goes a byte at a time)
+    uint8_t *data;    // the bytes
+    uint64_t *words;  // the same memory, as words
     size_t bit_count, byte_count;
+    size_t whole_words;  // words that can be used as words, anything past them goes a byte at a time
+    // "Is full" summary for ffz. summary[0] has one bit per 64-bit data word, summary[n] has one bit
+    // per word of summary[n - 1], and the top level is a single word. Bits past the end of a level are set.
+    // Always ours, even for overlays, so it's built from data on creation and kept current by every mutator.
+    unsigned summary_levels;
+    uint64_t *summary[SUMMARY_LEVEL_MAX];
 };
 
 
@@ -18,8 +32,8 @@ struct bitmap {
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
 // lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
+// Single bits still go straight at their byte: it's the same memory as the word either way,
+// and bytes don't care about byte order or how much of the last word there is
 static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
 
 // Mask for all bits at index i and lower
@@ -28,42 +42,209 @@ static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3
 // Inverted mask
 static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
 
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-    unsigned int v; // count the number of bits set in v
-    unsigned int c; // c accumulates the total bits set in v
-
-    for (c = 0; v; v >>= 1)
-    {
-      c += v & 1;
-    }
-*/
-
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Word-at-a-time access
+// Bit n lives at (1 << (n & 7)) in byte n >> 3, which is exactly where a little-endian 64-bit load puts it
+// So we can pull 8 bytes at a time and let ctz/popcount do the work instead of going bit by bit.
+// An overlay's short last word is assembled a byte at a time so we never read past byte_count.
+#define WORD_COUNT(bitmap) (((bitmap)->bit_count + 63) >> 6)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WORD_ORDER(word) __builtin_bswap64(word)
+#else
+#define WORD_ORDER(word) (word)
+#endif
+
+// Mask of the bits in the given word that are actually part of the bitmap
+// (everything except the final word is all ones)
+static inline uint64_t bitmap_word_mask(const bitmap_t *const bitmap, const size_t word) {
+    const size_t remaining = bitmap->bit_count - (word << 6);
+    return remaining >= 64 ? UINT64_MAX : ((UINT64_C(1) << remaining) - 1);
+}
+
+static inline uint64_t bitmap_load_word(const bitmap_t *const bitmap, const size_t word) {
+    uint64_t result = 0;
+    if (word < bitmap->whole_words) {
+        result = WORD_ORDER(bitmap->words[word]);
+    } else {
+        const size_t byte = word << 3;
+        const size_t end  = byte + 8 < bitmap->byte_count ? byte + 8 : bitmap->byte_count;
+        for (size_t idx = byte; idx < end; ++idx) {
+            result |= ((uint64_t) bitmap->data[idx]) << ((idx - byte) << 3);
+        }
+    }
+    return result & bitmap_word_mask(bitmap, word);
+}
+
+// Bits set in the first count words, which have to be whole ones
+// Byte order doesn't change a count, so the words are taken as they are
+// x86-64 only guarantees POPCNT from x86-64-v2 on, so that build is picked at load time on CPUs that have it
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+__attribute__((target_clones("popcnt", "default")))
+#endif
+#endif
+static size_t bitmap_count_words(const uint64_t *const words, const size_t count) {
+    size_t total = 0;
+    for (size_t idx = 0; idx < count; ++idx) {
+        total += __builtin_popcountll(words[idx]);
+    }
+    return total;
+}
+
+// Bits set in words [first, end)
+// Whole words go straight to bitmap_count_words, except the last of the bitmap, which can have bits past the end
+static size_t bitmap_count_span(const bitmap_t *const bitmap, const size_t first, const size_t end) {
+    const size_t last  = WORD_COUNT(bitmap) - 1;
+    size_t whole       = end < bitmap->whole_words ? end : bitmap->whole_words;
+    whole              = whole < last ? whole : last;
+    size_t total       = first < whole ? bitmap_count_words(bitmap->words + first, whole - first) : 0;
+    for (size_t idx = first > whole ? first : whole; idx < end; ++idx) {
+        total += __builtin_popcountll(bitmap_load_word(bitmap, idx));
+    }
+    return total;
+}
+
+static inline bool bitmap_word_full(const bitmap_t *const bitmap, const size_t word) {
+    return (bitmap_load_word(bitmap, word) | ~bitmap_word_mask(bitmap, word)) == UINT64_MAX;
+}
+
+// Data word idx just filled up, mark it and every level above that fills up with it
+static inline void bitmap_summary_mark(bitmap_t *const bitmap, size_t idx) {
+    for (unsigned level = 0; level < bitmap->summary_levels; ++level, idx >>= 6) {
+        uint64_t *const word = &bitmap->summary[level][idx >> 6];
+        *word |= UINT64_C(1) << (idx & 63);
+        if (*word != UINT64_MAX) {
+            break;
+        }
+    }
+}
+
+// Data word idx has a zero now, clear it up the levels until we hit one that already knew
+static inline void bitmap_summary_clear(bitmap_t *const bitmap, size_t idx) {
+    for (unsigned level = 0; level < bitmap->summary_levels; ++level, idx >>= 6) {
+        uint64_t *const word = &bitmap->summary[level][idx >> 6];
+        const bool was_full  = (*word == UINT64_MAX);
+        *word &= ~(UINT64_C(1) << (idx & 63));
+        if (!was_full) {
+            break;
+        }
+    }
+}
+
+static inline void bitmap_summary_update(bitmap_t *const bitmap, const size_t idx) {
+    if (bitmap_word_full(bitmap, idx)) {
+        bitmap_summary_mark(bitmap, idx);
+    } else {
+        bitmap_summary_clear(bitmap, idx);
+    }
+}
+
+// Summary word for the searches. Atomic claims can be marking the summary from other threads while we read it,
+// so reads go through a relaxed atomic load (a plain load on anything we'd run on, but one the compiler can't
+// cache or split). A stale word only ever has too few bits set, which the searches already step over
+static inline uint64_t bitmap_summary_load(const bitmap_t *const bitmap, const unsigned level, const size_t idx) {
+    return __atomic_load_n(&bitmap->summary[level][idx], __ATOMIC_RELAXED);
+}
+
+// Number of words in the given summary level (each level is 1/64th the one below, rounded up)
+static inline size_t bitmap_summary_words(const bitmap_t *const bitmap, const unsigned level) {
+    const unsigned shift = 6 * (level + 1);
+    return (WORD_COUNT(bitmap) + (((size_t) 1) << shift) - 1) >> shift;
+}
+
+// First clear bit at or after idx in the given summary level, SIZE_MAX if there isn't one
+// Climbs a level whenever the rest of the current word is full. With atomic claims about, the word the level
+// above points at can fill up before we read it, so that just sends us back up for the next one
+static size_t bitmap_summary_next_clear(const bitmap_t *const bitmap, const unsigned level, const size_t idx) {
+    if ((idx >> 6) >= bitmap_summary_words(bitmap, level)) {
+        return SIZE_MAX;
+    }
+    size_t word_idx = idx >> 6;
+    uint64_t word   = ~bitmap_summary_load(bitmap, level, word_idx) & (UINT64_MAX << (idx & 63));
+    while (!word) {
+        if (level + 1 == bitmap->summary_levels) {
+            return SIZE_MAX;
+        }
+        word_idx = bitmap_summary_next_clear(bitmap, level + 1, word_idx + 1);
+        if (word_idx == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        word = ~bitmap_summary_load(bitmap, level, word_idx);
+    }
+    return (word_idx << 6) + __builtin_ctzll(word);
+}
+
+// Rebuilds the summary from scratch, for when data changed in bulk
+static void bitmap_summarize(bitmap_t *const bitmap) {
+    size_t count = WORD_COUNT(bitmap);  // bits in the level being built
+    for (unsigned level = 0; level < bitmap->summary_levels; ++level) {
+        uint64_t *const words = bitmap->summary[level];
+        const size_t word_count = (count + 63) >> 6;
+        memset(words, 0x00, word_count << 3);
+        for (size_t idx = 0; idx < count; ++idx) {
+            if (level ? bitmap->summary[level - 1][idx] == UINT64_MAX : bitmap_word_full(bitmap, idx)) {
+                words[idx >> 6] |= UINT64_C(1) << (idx & 63);
+            }
+        }
+        if (count & 63) {
+            words[word_count - 1] |= ~((UINT64_C(1) << (count & 63)) - 1);
+        }
+        count = word_count;
+    }
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
     bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    if (bitmap->summary_levels && bitmap_word_full(bitmap, bit >> 6)) {
+        bitmap_summary_mark(bitmap, bit >> 6);
+    }
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) {
     bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    bitmap_summary_clear(bitmap, bit >> 6);
+}
+
+// Sets or clears [first, first + count): partial bytes at the ends get masked, everything between is one memset
+// The summary then only has to hear about each word touched once
+static void bitmap_write_range(bitmap_t *const bitmap, const size_t first, const size_t count, const bool value) {
+    if (!count) {
+        return;
+    }
+    const size_t last       = first + count - 1;
+    size_t first_byte       = first >> 3;
+    const size_t last_byte  = last >> 3;
+    const uint8_t head_mask = (uint8_t)(0xFF << (first & 0x07));
+    const uint8_t tail_mask = mask_down_inclusive[last & 0x07];
+    if (first_byte == last_byte) {
+        const uint8_t bits = head_mask & tail_mask;
+        bitmap->data[first_byte] = value ? bitmap->data[first_byte] | bits : bitmap->data[first_byte] & ~bits;
+    } else {
+        bitmap->data[first_byte] = value ? bitmap->data[first_byte] | head_mask : bitmap->data[first_byte] & ~head_mask;
+        bitmap->data[last_byte]  = value ? bitmap->data[last_byte] | tail_mask : bitmap->data[last_byte] & ~tail_mask;
+        ++first_byte;
+        if (first_byte < last_byte) {
+            memset(bitmap->data + first_byte, value ? 0xFF : 0x00, last_byte - first_byte);
+        }
+    }
+    for (size_t word = first >> 6; word <= last >> 6 && bitmap->summary_levels; ++word) {
+        if (!value) {
+            bitmap_summary_clear(bitmap, word);
+        } else if (bitmap_word_full(bitmap, word)) {
+            bitmap_summary_mark(bitmap, word);
+        }
+    }
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t first, const size_t count) {
+    bitmap_write_range(bitmap, first, count, true);
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t first, const size_t count) {
+    bitmap_write_range(bitmap, first, count, false);
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
@@ -72,30 +253,201 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) {
     bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    bitmap_summary_update(bitmap, bit >> 6);
 }
 
 void bitmap_invert(bitmap_t *const bitmap) {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) {
+    for (size_t word = 0; word < bitmap->whole_words; ++word) {
+        bitmap->words[word] = ~bitmap->words[word];
+    }
+    for (size_t byte = bitmap->whole_words << 3; byte < bitmap->byte_count; ++byte) {
         bitmap->data[byte] = ~bitmap->data[byte];
     }
+    bitmap_summarize(bitmap);
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
+    return bitmap_next_set(bitmap, 0);
+}
+
+// First data word the summary doesn't have as full, SIZE_MAX if they all are
+// Walk down the summary, taking the first not-full word at each level
+// Lowest at every level means lowest overall, so this matches a linear scan
+static size_t bitmap_summary_first_clear(const bitmap_t *const bitmap) {
+    size_t idx = 0;
+    for (unsigned level = bitmap->summary_levels; level-- > 0;) {
+        const uint64_t word = ~bitmap_summary_load(bitmap, level, idx);
+        if (!word) {
+            return SIZE_MAX;  // can only happen at the top
+        }
+        idx = (idx << 6) + __builtin_ctzll(word);
+    }
+    return idx;
+}
+
+size_t bitmap_ffz(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) {
+        const size_t idx = bitmap_summary_first_clear(bitmap);
+        if (idx == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        // Bits past the end are masked out, so they can never be found here
+        const uint64_t word = ~bitmap_load_word(bitmap, idx) & bitmap_word_mask(bitmap, idx);
+        if (word) {
+            return (idx << 6) + __builtin_ctzll(word);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
-size_t bitmap_ffz(const bitmap_t *const bitmap) {
+// Atomic claims
+// Whole words are claimed with one CAS (or fetch-or) on the word, so threads taking different bits of it
+// never lose each other's. Overlays that aren't word aligned, and a short last word, fall back to the same
+// on their bytes. The thread whose claim fills a data word is the one that marks it in the summary, which it
+// does with fetch-or, so the summary stays exact and ffz keeps working alongside. Claims only ever set bits,
+// anything that clears them (reset, reset_range, invert...) still needs the caller to keep other threads out.
+
+// Data word idx was just filled by an atomic claim, bitmap_summary_mark for when other threads can be marking too
+static void bitmap_summary_mark_atomic(bitmap_t *const bitmap, size_t idx) {
+    for (unsigned level = 0; level < bitmap->summary_levels; ++level, idx >>= 6) {
+        const uint64_t bit = UINT64_C(1) << (idx & 63);
+        const uint64_t old = __atomic_fetch_or(&bitmap->summary[level][idx >> 6], bit, __ATOMIC_SEQ_CST);
+        // Only the one that fills a summary word carries on up
+        if ((old | bit) != UINT64_MAX) {
+            break;
+        }
+    }
+}
+
+// Whether data word idx is full, for words claimed a byte at a time
+// Sequentially consistent, so of two threads filling the last bytes at once at least one sees the word full
+static bool bitmap_bytes_full_atomic(bitmap_t *const bitmap, const size_t idx) {
+    const size_t byte = idx << 3;
+    const size_t end  = byte + 8 < bitmap->byte_count ? byte + 8 : bitmap->byte_count;
+    uint64_t word     = 0;
+    for (size_t pos = byte; pos < end; ++pos) {
+        word |= ((uint64_t) __atomic_load_n(&bitmap->data[pos], __ATOMIC_SEQ_CST)) << ((pos - byte) << 3);
+    }
+    return (word | ~bitmap_word_mask(bitmap, idx)) == UINT64_MAX;
+}
+
+// Claims the lowest zero bit in data word idx, SIZE_MAX if it's full (or fills up under us)
+static size_t bitmap_claim_zero_atomic(bitmap_t *const bitmap, const size_t idx) {
+    const uint64_t valid = bitmap_word_mask(bitmap, idx);
+    if (idx < bitmap->whole_words) {
+        uint64_t *const target = bitmap->words + idx;
+        uint64_t old           = __atomic_load_n(target, __ATOMIC_RELAXED);
+        for (;;) {
+            const uint64_t zeroes = ~WORD_ORDER(old) & valid;
+            if (!zeroes) {
+                return SIZE_MAX;
+            }
+            const uint64_t bit = zeroes & -zeroes;
+            // A failed CAS refreshes old, so just go again with whatever beat us to it
+            if (__atomic_compare_exchange_n(target, &old, old | WORD_ORDER(bit), true, __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED)) {
+                if (zeroes == bit) {
+                    bitmap_summary_mark_atomic(bitmap, idx);
+                }
+                return (idx << 6) + __builtin_ctzll(bit);
+            }
+        }
+    }
+    const size_t byte = idx << 3;
+    const size_t end  = byte + 8 < bitmap->byte_count ? byte + 8 : bitmap->byte_count;
+    for (size_t pos = byte; pos < end; ++pos) {
+        const uint8_t byte_valid = (uint8_t)(valid >> ((pos - byte) << 3));
+        uint8_t old              = __atomic_load_n(&bitmap->data[pos], __ATOMIC_RELAXED);
+        for (uint8_t zeroes = ~old & byte_valid; zeroes; zeroes = ~old & byte_valid) {
+            const uint8_t bit = zeroes & -zeroes;
+            if (__atomic_compare_exchange_n(&bitmap->data[pos], &old, (uint8_t)(old | bit), true, __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED)) {
+                if (bitmap_bytes_full_atomic(bitmap, idx)) {
+                    bitmap_summary_mark_atomic(bitmap, idx);
+                }
+                return (pos << 3) + __builtin_ctz(bit);
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+bool bitmap_test_and_set_atomic(bitmap_t *const bitmap, const size_t bit) {
+    if (!bitmap || bit >= bitmap->bit_count) {
+        return true;
+    }
+    const size_t idx = bit >> 6;
+    if (idx < bitmap->whole_words) {
+        const uint64_t want  = UINT64_C(1) << (bit & 63);
+        const uint64_t valid = bitmap_word_mask(bitmap, idx);
+        const uint64_t old   = WORD_ORDER(__atomic_fetch_or(bitmap->words + idx, WORD_ORDER(want), __ATOMIC_SEQ_CST));
+        if (old & want) {
+            return true;
+        }
+        if (((old | want) & valid) == valid) {
+            bitmap_summary_mark_atomic(bitmap, idx);
+        }
+        return false;
+    }
+    if (__atomic_fetch_or(&bitmap->data[bit >> 3], mask[bit & 0x07], __ATOMIC_SEQ_CST) & mask[bit & 0x07]) {
+        return true;
+    }
+    if (bitmap_bytes_full_atomic(bitmap, idx)) {
+        bitmap_summary_mark_atomic(bitmap, idx);
+    }
+    return false;
+}
+
+size_t bitmap_ffz_and_set_atomic(bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+        // The summary never has a word as full that isn't, so nothing before where it points is free.
+        // Words that fill up before we get to them (or that the summary hasn't heard about yet) are stepped over.
+        // Searched with next_clear rather than a walk down from the top, since that copes with the summary
+        // filling up under it
+        const size_t word_count = WORD_COUNT(bitmap);
+        size_t idx              = bitmap->summary_levels ? bitmap_summary_next_clear(bitmap, 0, 0) : 0;
+        while (idx < word_count) {
+            const size_t claimed = bitmap_claim_zero_atomic(bitmap, idx);
+            if (claimed != SIZE_MAX) {
+                return claimed;
+            }
+            idx = bitmap->summary_levels ? bitmap_summary_next_clear(bitmap, 0, idx + 1) : idx + 1;
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from) {
+    if (bitmap && from < bitmap->bit_count) {
+        size_t idx    = from >> 6;
+        uint64_t word = ~bitmap_load_word(bitmap, idx) & bitmap_word_mask(bitmap, idx) & (UINT64_MAX << (from & 63));
+        if (!word && bitmap->summary_levels) {
+            // Rest of this word is full, let the summary find the next word that isn't
+            idx = bitmap_summary_next_clear(bitmap, 0, idx + 1);
+            if (idx == SIZE_MAX) {
+                return SIZE_MAX;
+            }
+            word = ~bitmap_load_word(bitmap, idx) & bitmap_word_mask(bitmap, idx);
+        }
+        if (word) {
+            return (idx << 6) + __builtin_ctzll(word);
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from) {
+    if (bitmap && from < bitmap->bit_count) {
+        // Empty words are skipped whole, the rest of the first one is masked off below from
+        const size_t word_count = WORD_COUNT(bitmap);
+        size_t idx              = from >> 6;
+        uint64_t word           = bitmap_load_word(bitmap, idx) & (UINT64_MAX << (from & 63));
+        while (!word && ++idx < word_count) {
+            word = bitmap_load_word(bitmap, idx);
+        }
+        if (word) {
+            return (idx << 6) + __builtin_ctzll(word);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
@@ -103,27 +455,136 @@ size_t bitmap_ffz(const bitmap_t *const bitmap) {
 size_t bitmap_total_set(const bitmap_t *const bitmap) {
     size_t total = 0;
     if (bitmap) {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) {
-            total += bit_totals[bitmap->data[idx]];
+        total = bitmap_count_span(bitmap, 0, WORD_COUNT(bitmap));
+    }
+    return total;
+}
+
+// Ranges are [first, last] inclusive in here. The words at either end only count the bits inside the range
+#define RANGE_HEAD_MASK(first) (UINT64_MAX << ((first) & 63))
+#define RANGE_TAIL_MASK(last) (UINT64_MAX >> (63 - ((last) & 63)))
+
+static inline bool bitmap_range_valid(const bitmap_t *const bitmap, const size_t first, const size_t count) {
+    return bitmap && count && first < bitmap->bit_count && count <= bitmap->bit_count - first;
+}
+
+bool bitmap_range_all_set(const bitmap_t *const bitmap, const size_t first, const size_t count) {
+    if (bitmap_range_valid(bitmap, first, count)) {
+        const size_t last       = first + count - 1;
+        const size_t first_word = first >> 6;
+        const size_t last_word  = last >> 6;
+        if (first_word == last_word) {
+            const uint64_t wanted = RANGE_HEAD_MASK(first) & RANGE_TAIL_MASK(last);
+            return (bitmap_load_word(bitmap, first_word) & wanted) == wanted;
         }
-        if (bitmap->leftover_bits) {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+        if ((bitmap_load_word(bitmap, first_word) & RANGE_HEAD_MASK(first)) != RANGE_HEAD_MASK(first)
+            || (bitmap_load_word(bitmap, last_word) & RANGE_TAIL_MASK(last)) != RANGE_TAIL_MASK(last)) {
+            return false;
         }
+        for (size_t idx = first_word + 1; idx < last_word; ++idx) {
+            if (bitmap_load_word(bitmap, idx) != UINT64_MAX) {
+                return false;
+            }
+        }
+        return true;
     }
-    return total;
+    return false;
+}
+
+size_t bitmap_range_count(const bitmap_t *const bitmap, const size_t first, const size_t count) {
+    if (bitmap_range_valid(bitmap, first, count)) {
+        const size_t last       = first + count - 1;
+        const size_t first_word = first >> 6;
+        const size_t last_word  = last >> 6;
+        if (first_word == last_word) {
+            return __builtin_popcountll(bitmap_load_word(bitmap, first_word) & RANGE_HEAD_MASK(first)
+                                        & RANGE_TAIL_MASK(last));
+        }
+        return __builtin_popcountll(bitmap_load_word(bitmap, first_word) & RANGE_HEAD_MASK(first))
+               + bitmap_count_span(bitmap, first_word + 1, last_word)
+               + __builtin_popcountll(bitmap_load_word(bitmap, last_word) & RANGE_TAIL_MASK(last));
+    }
+    return 0;
+}
+
+// Bits of word where a run of len (< 64) zeroes starts and fits inside the word
+// Shift-and-AND folding, each round doubles the run length every surviving bit vouches for
+static inline uint64_t bitmap_zero_run_starts(const uint64_t word, const size_t len) {
+    uint64_t starts = ~word;
+    for (size_t have = 1; have < len && starts;) {
+        const size_t shift = have < len - have ? have : len - have;
+        starts &= starts >> shift;
+        have += shift;
+    }
+    return starts;
+}
+
+// First run of len zeroes in [from, end), one pass over the words
+// The zero run carried in from the previous word is extended by each word's trailing zeroes,
+// runs inside a word are found by folding, and the next word picks up from this one's leading zeroes
+static size_t bitmap_scan_zero_run(const bitmap_t *const bitmap, const size_t len, const size_t from, const size_t end) {
+    if (from >= end || end - from < len) {
+        return SIZE_MAX;
+    }
+    const size_t last_word = (end - 1) >> 6;
+    size_t run_start       = from;
+    size_t run             = 0;
+    for (size_t idx = from >> 6; idx <= last_word; ++idx) {
+        // Everything outside [from, end) reads as taken
+        uint64_t word = bitmap_load_word(bitmap, idx);
+        if (idx == from >> 6) {
+            word |= ~RANGE_HEAD_MASK(from);
+        }
+        if (idx == last_word) {
+            word |= ~RANGE_TAIL_MASK(end - 1);
+        }
+        if (!word) {
+            run += 64;
+            if (run >= len) {
+                return run_start;
+            }
+            continue;
+        }
+        if (run + __builtin_ctzll(word) >= len) {
+            return run_start;
+        }
+        if (len < 64) {
+            const uint64_t starts = bitmap_zero_run_starts(word, len);
+            if (starts) {
+                return (idx << 6) + __builtin_ctzll(starts);
+            }
+        }
+        run       = __builtin_clzll(word);
+        run_start = (idx << 6) + 64 - run;
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t len, const size_t from) {
+    return bitmap && len ? bitmap_scan_zero_run(bitmap, len, from, bitmap->bit_count) : SIZE_MAX;
+}
+
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t run_len, const size_t start_hint) {
+    if (bitmap && run_len) {
+        const size_t hint = start_hint < bitmap->bit_count ? start_hint : 0;
+        const size_t run  = bitmap_scan_zero_run(bitmap, run_len, hint, bitmap->bit_count);
+        if (run != SIZE_MAX || !hint) {
+            return run;
+        }
+        // Nothing past the hint, wrap around. Only runs starting before the hint are left to find
+        const size_t wrap_end = hint + run_len - 1;
+        return bitmap_scan_zero_run(bitmap, run_len, 0, wrap_end < bitmap->bit_count ? wrap_end : bitmap->bit_count);
+    }
+    return SIZE_MAX;
 }
 
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
     if (bitmap && func) {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) {
-            if (bitmap_test(bitmap, idx)) {
-                func(idx, arg);
+        // A word at a time, peeling its set bits off lowest first
+        const size_t word_count = WORD_COUNT(bitmap);
+        for (size_t idx = 0; idx < word_count; ++idx) {
+            for (uint64_t word = bitmap_load_word(bitmap, idx); word; word &= word - 1) {
+                func((idx << 6) + __builtin_ctzll(word), arg);
             }
         }
     }
@@ -131,6 +592,7 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) {
     memset(bitmap->data, pattern, bitmap->byte_count);
+    bitmap_summarize(bitmap);
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) {
@@ -154,6 +616,7 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, NONE);
         if (bitmap) {
             memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            bitmap_summarize(bitmap);
             return bitmap;
         }
     }
@@ -165,6 +628,12 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) {
             bitmap->data = (uint8_t *) bitmap_data;
+            // Anything not word aligned is left to the byte at a time paths
+            if (!((uintptr_t) bitmap_data & (sizeof(uint64_t) - 1))) {
+                bitmap->words       = (uint64_t *) bitmap_data;
+                bitmap->whole_words = bitmap->byte_count >> 3;
+            }
+            bitmap_summarize(bitmap);
             return bitmap;
         }
     }
@@ -177,6 +646,7 @@ void bitmap_destroy(bitmap_t *bitmap) {
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        free(bitmap->summary[0]);
         free(bitmap);
     }
 }
@@ -197,6 +667,28 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
 
+            // Size up the summary levels, all in one allocation
+            // (a bitmap of one word has nothing to summarize)
+            size_t summary_words = 0;
+            bitmap->summary_levels = 0;
+            for (size_t count = WORD_COUNT(bitmap); count > 1; count = (count + 63) >> 6) {
+                summary_words += (count + 63) >> 6;
+                ++bitmap->summary_levels;
+            }
+            bitmap->summary[0] = NULL;
+            if (summary_words) {
+                bitmap->summary[0] = (uint64_t *) malloc(summary_words << 3);
+                if (!bitmap->summary[0]) {
+                    free(bitmap);
+                    return NULL;
+                }
+                size_t count = WORD_COUNT(bitmap);
+                for (unsigned level = 1; level < bitmap->summary_levels; ++level) {
+                    count                  = (count + 63) >> 6;
+                    bitmap->summary[level] = bitmap->summary[level - 1] + count;
+                }
+            }
+
             // FLAG HANDLING HERE
 
             // This logic will need to be reworked when we have more than one flag, haha
@@ -205,15 +697,21 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
 
             if (FLAG_CHECK(bitmap, OVERLAY)) {
                 // don't mess with data, caller will set it
-                bitmap->data = NULL;
+                bitmap->data        = NULL;
+                bitmap->words       = NULL;
+                bitmap->whole_words = 0;
                 return bitmap;
             } else {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+                bitmap->whole_words = WORD_COUNT(bitmap);
+                bitmap->words       = (uint64_t *) calloc(bitmap->whole_words, sizeof(uint64_t));
+                bitmap->data        = (uint8_t *) bitmap->words;
                 if (bitmap->data) {
+                    bitmap_summarize(bitmap);
                     return bitmap;
                 }
             }
 
+            free(bitmap->summary[0]);
             free(bitmap);
         }
     }
@@ -2,6 +2,7 @@
 #include "../src/bitmap.c"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -115,12 +116,38 @@ void for_each_test(size_t bit_num, void *value) {
     for_each_counter += bit_num + (*((size_t *) value));
 }
 
+// Collects the bits bitmap_for_each hands over
+typedef struct {
+    size_t bits[16];
+    size_t count;
+} for_each_record_t;
+
+void for_each_record(size_t bit_num, void *record) {
+    for_each_record_t *const seen = (for_each_record_t *) record;
+    if (seen->count < 16) {
+        seen->bits[seen->count] = bit_num;
+    }
+    ++seen->count;
+}
+
 void bitmap_test_a();
 
 void bitmap_test_b();
 
 void bitmap_test_c();
 
+void bitmap_test_d();
+
+void bitmap_test_e();
+
+void bitmap_test_f();
+
+void bitmap_test_g();
+
+void bitmap_test_h();
+
+void bitmap_test_i();
+
 int main() {
     // EVERYTHING ELSE
     bitmap_test_a();
@@ -131,6 +158,24 @@ int main() {
     // OVERLAY INVERT TOTAL_SET
     bitmap_test_c();
 
+    // SET_RANGE/RESET_RANGE
+    bitmap_test_d();
+
+    // WORD STORAGE
+    bitmap_test_e();
+
+    // NEXT_SET/FOR_EACH
+    bitmap_test_f();
+
+    // RANGE_ALL_SET/RANGE_COUNT/FIND_ZERO_RUN
+    bitmap_test_g();
+
+    // FFZ_RUN
+    bitmap_test_h();
+
+    // TEST_AND_SET_ATOMIC/FFZ_AND_SET_ATOMIC
+    bitmap_test_i();
+
     // Done. GO TEAM!
 
     puts("TESTS PASSED");
@@ -138,7 +183,7 @@ int main() {
 
 void bitmap_test_a() {
     bitmap_t *bitmap_A = NULL, *bitmap_B = NULL;
-    const size_t test_bit_count = 58;  //, test_byte_count = 8;
+    const size_t test_bit_count = 58, test_byte_count = 8;
     // 58 bits = 7.2 bytes
 
     // INIT/DESTRUCT to get them out of the way
@@ -553,8 +598,71 @@ void bitmap_test_b() {
     bitmap_reset(bitmap_A, 57);
 
     assert(bitmap_ffz(bitmap_A) == 57);
+    assert(bitmap_next_zero(bitmap_A, 20) == 57);
+    assert(bitmap_next_zero(bitmap_A, 58) == SIZE_MAX);
+    assert(bitmap_next_zero(NULL, 0) == SIZE_MAX);
+
+    bitmap_destroy(bitmap_A);
+
+    // Now across word boundaries, with a ragged tail
+    bitmap_A = bitmap_create(200);
+    assert(bitmap_A);
+
+    bitmap_set(bitmap_A, 130);
+    assert(bitmap_ffs(bitmap_A) == 130);
+
+    bitmap_format(bitmap_A, 0xFF);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+
+    bitmap_reset(bitmap_A, 199);
+    assert(bitmap_ffz(bitmap_A) == 199);
+
+    bitmap_reset(bitmap_A, 64);
+    assert(bitmap_ffz(bitmap_A) == 64);
+
+    bitmap_reset(bitmap_A, 63);
+    assert(bitmap_ffz(bitmap_A) == 63);
+
+    bitmap_destroy(bitmap_A);
+
+    // Big enough for a few summary levels, laid over memory like the block_store FBM
+    const size_t big_bit_count = 65536 * 4 + 3;
+    uint8_t *big_data = (uint8_t *) malloc((big_bit_count >> 3) + 1);
+    assert(big_data);
+    memset(big_data, 0xFF, (big_bit_count >> 3) + 1);
+    big_data[100] = 0x7F;
+    bitmap_A = bitmap_overlay(big_bit_count, big_data);
+    assert(bitmap_A);
+
+    assert(bitmap_ffz(bitmap_A) == 807);
+    bitmap_set(bitmap_A, 807);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+
+    bitmap_reset(bitmap_A, big_bit_count - 1);
+    assert(bitmap_ffz(bitmap_A) == big_bit_count - 1);
+    bitmap_reset(bitmap_A, 70000);
+    assert(bitmap_ffz(bitmap_A) == 70000);
+    bitmap_flip(bitmap_A, 70000);
+    assert(bitmap_ffz(bitmap_A) == big_bit_count - 1);
+    bitmap_flip(bitmap_A, 5);
+    assert(bitmap_ffz(bitmap_A) == 5);
+    assert(!(big_data[0] & 0x20));
+
+    assert(bitmap_next_zero(bitmap_A, 6) == big_bit_count - 1);
+    assert(bitmap_next_zero(bitmap_A, big_bit_count - 1) == big_bit_count - 1);
+    assert(bitmap_next_zero(bitmap_A, big_bit_count) == SIZE_MAX);
+    bitmap_reset(bitmap_A, 4096 * 64 + 1);
+    assert(bitmap_next_zero(bitmap_A, 6) == 4096 * 64 + 1);
+    assert(bitmap_next_zero(bitmap_A, 4096 * 64 + 2) == big_bit_count - 1);
+
+    bitmap_format(bitmap_A, 0xFF);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+    assert(bitmap_next_zero(bitmap_A, 0) == SIZE_MAX);
+    bitmap_invert(bitmap_A);
+    assert(bitmap_ffz(bitmap_A) == 0);
 
     bitmap_destroy(bitmap_A);
+    free(big_data);
 }
 
 void bitmap_test_c() {
@@ -626,3 +734,358 @@ void bitmap_test_c() {
     assert(bitmap_a);
     assert(bitmap_total_set(bitmap_a) == 35);
 }
+
+void bitmap_test_d() {
+    bitmap_t *bitmap_A = bitmap_create(1000);
+    assert(bitmap_A);
+
+    // Inside one byte
+    bitmap_set_range(bitmap_A, 2, 3);
+    assert(bitmap_export(bitmap_A)[0] == 0x1C);
+    bitmap_reset_range(bitmap_A, 3, 1);
+    assert(bitmap_export(bitmap_A)[0] == 0x14);
+    bitmap_reset_range(bitmap_A, 0, 8);
+    assert(bitmap_total_set(bitmap_A) == 0);
+
+    // Ragged at both ends, across words
+    bitmap_set_range(bitmap_A, 5, 300);
+    assert(bitmap_total_set(bitmap_A) == 300);
+    assert(!bitmap_test(bitmap_A, 4) && bitmap_test(bitmap_A, 5));
+    assert(bitmap_test(bitmap_A, 304) && !bitmap_test(bitmap_A, 305));
+    assert(bitmap_ffz(bitmap_A) == 0);
+    assert(bitmap_next_zero(bitmap_A, 5) == 305);
+
+    bitmap_reset_range(bitmap_A, 64, 128);
+    assert(bitmap_total_set(bitmap_A) == 172);
+    assert(bitmap_next_zero(bitmap_A, 5) == 64);
+    assert(bitmap_next_zero(bitmap_A, 192) == 305);
+
+    // Nothing at all
+    bitmap_set_range(bitmap_A, 500, 0);
+    assert(bitmap_total_set(bitmap_A) == 172);
+
+    // Up to the very last bit, the summary has to notice the whole thing filling up
+    bitmap_set_range(bitmap_A, 0, 1000);
+    assert(bitmap_total_set(bitmap_A) == 1000);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+    bitmap_reset_range(bitmap_A, 999, 1);
+    assert(bitmap_ffz(bitmap_A) == 999);
+    bitmap_set_range(bitmap_A, 999, 1);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+
+    bitmap_destroy(bitmap_A);
+
+    // Several summary levels
+    const size_t big_bit_count = 65536 * 4 + 3;
+    bitmap_A = bitmap_create(big_bit_count);
+    assert(bitmap_A);
+    bitmap_set_range(bitmap_A, 0, big_bit_count);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+    bitmap_reset_range(bitmap_A, 70001, 4096);
+    assert(bitmap_ffz(bitmap_A) == 70001);
+    assert(bitmap_next_zero(bitmap_A, 70001 + 4096) == SIZE_MAX);
+    bitmap_set_range(bitmap_A, 70001, 4095);
+    assert(bitmap_ffz(bitmap_A) == 70001 + 4095);
+    assert(bitmap_total_set(bitmap_A) == big_bit_count - 1);
+    bitmap_destroy(bitmap_A);
+}
+
+void bitmap_test_e() {
+    // Counts and byte layout at and around word boundaries
+    const size_t sizes[] = {1, 7, 63, 64, 65, 200, 4097};
+    for (size_t idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); ++idx) {
+        bitmap_t *bitmap_A = bitmap_create(sizes[idx]);
+        assert(bitmap_A);
+        size_t expected = 0;
+        for (size_t bit = 0; bit < sizes[idx]; bit += 3) {
+            bitmap_set(bitmap_A, bit);
+            ++expected;
+        }
+        assert(bitmap_total_set(bitmap_A) == expected);
+        for (size_t bit = 0; bit < sizes[idx]; ++bit) {
+            assert(((bitmap_export(bitmap_A)[bit >> 3] >> (bit & 7)) & 1) == (bit % 3 == 0));
+        }
+        bitmap_invert(bitmap_A);
+        assert(bitmap_total_set(bitmap_A) == sizes[idx] - expected);
+        assert(bitmap_ffz(bitmap_A) == 0);
+        bitmap_destroy(bitmap_A);
+    }
+
+    // Overlays that aren't word aligned, and stop part way into a word, behave the same as ones that are
+    uint64_t storage[2][10];
+    uint8_t *const aligned   = (uint8_t *) storage[0];
+    uint8_t *const unaligned = (uint8_t *) storage[1] + 3;
+    for (size_t byte = 0; byte < 70; ++byte) {
+        aligned[byte] = unaligned[byte] = (uint8_t)(byte * 37 + 11);
+    }
+    bitmap_t *bitmap_A = bitmap_overlay(555, aligned);
+    bitmap_t *bitmap_B = bitmap_overlay(555, unaligned);
+    assert(bitmap_A && bitmap_B);
+    assert(bitmap_total_set(bitmap_A) == bitmap_total_set(bitmap_B));
+    assert(bitmap_ffs(bitmap_A) == bitmap_ffs(bitmap_B));
+    assert(bitmap_ffz(bitmap_A) == bitmap_ffz(bitmap_B));
+    bitmap_invert(bitmap_A);
+    bitmap_invert(bitmap_B);
+    assert(memcmp(aligned, unaligned, 70) == 0);
+    bitmap_set_range(bitmap_A, 0, 555);
+    bitmap_set_range(bitmap_B, 0, 555);
+    assert(bitmap_total_set(bitmap_A) == 555 && bitmap_total_set(bitmap_B) == 555);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX && bitmap_ffz(bitmap_B) == SIZE_MAX);
+    bitmap_reset(bitmap_B, 554);
+    assert(bitmap_next_zero(bitmap_B, 0) == 554);
+    bitmap_destroy(bitmap_A);
+    bitmap_destroy(bitmap_B);
+}
+
+void bitmap_test_f() {
+    const size_t expected[] = {0, 63, 64, 500, 998, 999};
+    bitmap_t *bitmap_A      = bitmap_create(1000);
+    assert(bitmap_A);
+    assert(bitmap_next_set(bitmap_A, 0) == SIZE_MAX);
+    assert(bitmap_ffs(bitmap_A) == SIZE_MAX);
+    for (size_t idx = 0; idx < 6; ++idx) {
+        bitmap_set(bitmap_A, expected[idx]);
+    }
+
+    assert(bitmap_ffs(bitmap_A) == 0);
+    assert(bitmap_next_set(bitmap_A, 1) == 63);
+    assert(bitmap_next_set(bitmap_A, 64) == 64);
+    assert(bitmap_next_set(bitmap_A, 65) == 500);
+    assert(bitmap_next_set(bitmap_A, 999) == 999);
+    assert(bitmap_next_set(bitmap_A, 1000) == SIZE_MAX);
+    assert(bitmap_next_set(NULL, 0) == SIZE_MAX);
+
+    // Walking it hits each set bit once, in order
+    size_t walked = 0;
+    for (size_t bit = bitmap_next_set(bitmap_A, 0); bit != SIZE_MAX; bit = bitmap_next_set(bitmap_A, bit + 1)) {
+        assert(walked < 6 && bit == expected[walked]);
+        ++walked;
+    }
+    assert(walked == 6);
+
+    for_each_record_t seen;
+    memset(&seen, 0, sizeof(seen));
+    bitmap_for_each(bitmap_A, &for_each_record, &seen);
+    assert(seen.count == 6);
+    assert(memcmp(seen.bits, expected, sizeof(expected)) == 0);
+
+    // Full, nothing past the end gets reported
+    bitmap_set_range(bitmap_A, 0, 1000);
+    memset(&seen, 0, sizeof(seen));
+    bitmap_for_each(bitmap_A, &for_each_record, &seen);
+    assert(seen.count == 1000);
+    assert(bitmap_next_set(bitmap_A, 998) == 998);
+    bitmap_destroy(bitmap_A);
+
+    // An overlay that stops part way into its last word
+    uint8_t arr[9];
+    memset(arr, 0xFF, sizeof(arr));
+    bitmap_A = bitmap_overlay(70, arr);
+    assert(bitmap_A);
+    bitmap_reset_range(bitmap_A, 0, 69);
+    assert(bitmap_next_set(bitmap_A, 0) == 69);
+    memset(&seen, 0, sizeof(seen));
+    bitmap_for_each(bitmap_A, &for_each_record, &seen);
+    assert(seen.count == 1 && seen.bits[0] == 69);
+    bitmap_destroy(bitmap_A);
+}
+
+void bitmap_test_g() {
+    bitmap_t *bitmap_A = bitmap_create(1000);
+    assert(bitmap_A);
+    bitmap_set_range(bitmap_A, 60, 200);
+    bitmap_set(bitmap_A, 500);
+    bitmap_set(bitmap_A, 999);
+
+    // Inside one word, across a boundary, across whole words
+    assert(bitmap_range_all_set(bitmap_A, 60, 4));
+    assert(bitmap_range_all_set(bitmap_A, 60, 200));
+    assert(!bitmap_range_all_set(bitmap_A, 59, 200));
+    assert(!bitmap_range_all_set(bitmap_A, 60, 201));
+    assert(bitmap_range_all_set(bitmap_A, 999, 1));
+    assert(!bitmap_range_all_set(bitmap_A, 999, 2));
+    assert(!bitmap_range_all_set(bitmap_A, 60, 0));
+    assert(!bitmap_range_all_set(NULL, 60, 4));
+
+    assert(bitmap_range_count(bitmap_A, 0, 1000) == 202);
+    assert(bitmap_range_count(bitmap_A, 0, 60) == 0);
+    assert(bitmap_range_count(bitmap_A, 62, 3) == 3);
+    assert(bitmap_range_count(bitmap_A, 250, 300) == 11);
+    assert(bitmap_range_count(bitmap_A, 990, 10) == 1);
+    assert(bitmap_range_count(bitmap_A, 990, 11) == 0);
+    assert(bitmap_range_count(NULL, 0, 10) == 0);
+
+    // Runs: 0-59, 260-499, 501-998
+    assert(bitmap_find_zero_run(bitmap_A, 60, 0) == 0);
+    assert(bitmap_find_zero_run(bitmap_A, 61, 0) == 260);
+    assert(bitmap_find_zero_run(bitmap_A, 240, 0) == 260);
+    assert(bitmap_find_zero_run(bitmap_A, 241, 0) == 501);
+    assert(bitmap_find_zero_run(bitmap_A, 10, 495) == 501);
+    assert(bitmap_find_zero_run(bitmap_A, 498, 0) == 501);
+    assert(bitmap_find_zero_run(bitmap_A, 499, 0) == SIZE_MAX);
+    assert(bitmap_find_zero_run(bitmap_A, 0, 0) == SIZE_MAX);
+    assert(bitmap_find_zero_run(bitmap_A, 1, 1000) == SIZE_MAX);
+    bitmap_destroy(bitmap_A);
+
+    // Same answers off an overlay that isn't word aligned
+    uint64_t storage[3];
+    memset(storage, 0, sizeof(storage));
+    bitmap_A = bitmap_overlay(150, (uint8_t *) storage + 1);
+    assert(bitmap_A);
+    bitmap_set_range(bitmap_A, 10, 120);
+    assert(bitmap_range_all_set(bitmap_A, 10, 120));
+    assert(bitmap_range_count(bitmap_A, 0, 150) == 120);
+    assert(bitmap_find_zero_run(bitmap_A, 11, 0) == 130);
+    assert(bitmap_find_zero_run(bitmap_A, 21, 0) == SIZE_MAX);
+    bitmap_destroy(bitmap_A);
+}
+
+// Bit at a time answer for find_zero_run to check against
+static size_t slow_zero_run(const bitmap_t *const bitmap, const size_t len, const size_t from) {
+    size_t run = 0;
+    for (size_t bit = from; bit < bitmap_get_bits(bitmap); ++bit) {
+        run = bitmap_test(bitmap, bit) ? 0 : run + 1;
+        if (run == len) {
+            return bit + 1 - len;
+        }
+    }
+    return SIZE_MAX;
+}
+
+void bitmap_test_h() {
+    bitmap_t *bitmap_A = bitmap_create(1000);
+    assert(bitmap_A);
+    // Runs: 0-9, 11-199, 210-299, 301-999
+    bitmap_set(bitmap_A, 10);
+    bitmap_set_range(bitmap_A, 200, 10);
+    bitmap_set(bitmap_A, 300);
+
+    assert(bitmap_ffz_run(bitmap_A, 10, 0) == 0);
+    assert(bitmap_ffz_run(bitmap_A, 11, 0) == 11);
+    assert(bitmap_ffz_run(bitmap_A, 90, 150) == 210);
+    assert(bitmap_ffz_run(bitmap_A, 91, 150) == 301);
+    assert(bitmap_ffz_run(bitmap_A, 699, 0) == 301);
+    assert(bitmap_ffz_run(bitmap_A, 700, 0) == SIZE_MAX);
+    // Wraps around, and the run it finds can cross the hint
+    assert(bitmap_ffz_run(bitmap_A, 100, 400) == 400);
+    assert(bitmap_ffz_run(bitmap_A, 100, 950) == 11);
+    assert(bitmap_ffz_run(bitmap_A, 150, 100) == 301);
+    assert(bitmap_ffz_run(bitmap_A, 600, 500) == 301);
+    assert(bitmap_ffz_run(bitmap_A, 5, 5000) == 0);
+    assert(bitmap_ffz_run(bitmap_A, 0, 0) == SIZE_MAX);
+    assert(bitmap_ffz_run(NULL, 5, 0) == SIZE_MAX);
+    bitmap_destroy(bitmap_A);
+
+    // Every length against a bit at a time search, over a pattern with runs of all sorts of lengths
+    bitmap_A = bitmap_create(777);
+    assert(bitmap_A);
+    unsigned seed = 12345;
+    for (size_t bit = 0; bit < 777; ++bit) {
+        seed = seed * 1103515245 + 12345;
+        if (((seed >> 16) & 0x7F) < 6) {
+            bitmap_set(bitmap_A, bit);
+        }
+    }
+    for (size_t len = 1; len < 300; ++len) {
+        assert(bitmap_find_zero_run(bitmap_A, len, 0) == slow_zero_run(bitmap_A, len, 0));
+        assert(bitmap_find_zero_run(bitmap_A, len, len) == slow_zero_run(bitmap_A, len, len));
+    }
+    bitmap_destroy(bitmap_A);
+}
+
+#define CLAIM_THREADS 4
+
+typedef struct {
+    bitmap_t *bitmap;
+    size_t claims;
+    size_t bits[4097];
+} claim_record_t;
+
+// Grabs bits until there are none left, keeping track of which
+static void *claim_until_full(void *arg) {
+    claim_record_t *const record = (claim_record_t *) arg;
+    for (size_t bit = bitmap_ffz_and_set_atomic(record->bitmap); bit != SIZE_MAX;
+         bit        = bitmap_ffz_and_set_atomic(record->bitmap)) {
+        record->bits[record->claims++] = bit;
+    }
+    return NULL;
+}
+
+// Races every other thread for every bit, counting the ones it won
+static void *claim_every_bit(void *arg) {
+    claim_record_t *const record = (claim_record_t *) arg;
+    for (size_t bit = 0; bit < bitmap_get_bits(record->bitmap); ++bit) {
+        if (!bitmap_test_and_set_atomic(record->bitmap, bit)) {
+            ++record->claims;
+        }
+    }
+    return NULL;
+}
+
+// Every bit handed out exactly once, and the summary agrees it's full
+static bool claims_cover(bitmap_t *const bitmap, void *(*claimer)(void *)) {
+    static claim_record_t records[CLAIM_THREADS];
+    pthread_t threads[CLAIM_THREADS];
+    for (size_t idx = 0; idx < CLAIM_THREADS; ++idx) {
+        records[idx].bitmap = bitmap;
+        records[idx].claims = 0;
+        if (pthread_create(&threads[idx], NULL, claimer, &records[idx])) {
+            return false;
+        }
+    }
+    size_t total = 0;
+    for (size_t idx = 0; idx < CLAIM_THREADS; ++idx) {
+        pthread_join(threads[idx], NULL);
+        total += records[idx].claims;
+    }
+    if (claimer == claim_until_full) {
+        bitmap_t *const seen = bitmap_create(bitmap_get_bits(bitmap));
+        for (size_t idx = 0; idx < CLAIM_THREADS; ++idx) {
+            for (size_t claim = 0; claim < records[idx].claims; ++claim) {
+                if (bitmap_test_and_set_atomic(seen, records[idx].bits[claim])) {
+                    bitmap_destroy(seen);
+                    return false;
+                }
+            }
+        }
+        bitmap_destroy(seen);
+    }
+    return total == bitmap_get_bits(bitmap) && bitmap_total_set(bitmap) == total && bitmap_ffz(bitmap) == SIZE_MAX;
+}
+
+void bitmap_test_i() {
+    bitmap_t *bitmap_A = bitmap_create(200);
+    assert(bitmap_A);
+    assert(!bitmap_test_and_set_atomic(bitmap_A, 70));
+    assert(bitmap_test_and_set_atomic(bitmap_A, 70));
+    assert(bitmap_test(bitmap_A, 70));
+    assert(bitmap_test_and_set_atomic(bitmap_A, 200));
+    assert(bitmap_test_and_set_atomic(NULL, 0));
+    assert(bitmap_ffz_and_set_atomic(NULL) == SIZE_MAX);
+
+    // Hands out the same order ffz would, and fills words the summary then knows about
+    for (size_t bit = 0; bit < 199; ++bit) {
+        assert(bitmap_ffz_and_set_atomic(bitmap_A) == (bit < 70 ? bit : bit + 1));
+    }
+    assert(bitmap_ffz_and_set_atomic(bitmap_A) == SIZE_MAX);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+    bitmap_reset(bitmap_A, 130);
+    assert(bitmap_ffz_and_set_atomic(bitmap_A) == 130);
+    bitmap_reset(bitmap_A, 199);
+    assert(!bitmap_test_and_set_atomic(bitmap_A, 199));
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+    bitmap_destroy(bitmap_A);
+
+    // Lots of threads at once, on our own storage and overlays aligned or not
+    uint64_t storage[66];
+    uint8_t *const overlays[] = {(uint8_t *) storage, (uint8_t *) storage + 5};
+    for (size_t pass = 0; pass < 3; ++pass) {
+        memset(storage, 0, sizeof(storage));
+        bitmap_A = pass ? bitmap_overlay(4097, overlays[pass - 1]) : bitmap_create(4097);
+        assert(bitmap_A);
+        assert(claims_cover(bitmap_A, claim_until_full));
+        bitmap_reset_range(bitmap_A, 0, 4097);
+        assert(claims_cover(bitmap_A, claim_every_bit));
+        bitmap_destroy(bitmap_A);
+    }
+}
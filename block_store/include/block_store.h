@@ -5,12 +5,68 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Geometry block_store_create uses, 65536 blocks of 512 bytes (32 MB)
+#define BLOCK_STORE_DEFAULT_BLOCK_SIZE (512)
+#define BLOCK_STORE_DEFAULT_BLOCK_COUNT (65536)
+
+// Blocks taken up by the free block map at the start of a store, they can't be allocated, read or written
+//  so this is also the first data block
+#define BLOCK_STORE_FBM_BLOCKS(block_size, block_count) (((block_count) + (block_size) * 8 - 1) / ((block_size) * 8))
 
 // Back store object
 // It's an opaque object whose implementation is up to you
 // (and implementation DOES NOT go here)
 typedef struct block_store block_store_t;
 
+// Read-only, point in time view of a block_store, from block_store_snapshot
+typedef struct block_store_snap block_store_snapshot_t;
+
+// Access pattern hints for block_store_advise
+typedef enum {
+    BS_ADVICE_NORMAL,      // No particular pattern
+    BS_ADVICE_SEQUENTIAL,  // Will be read in order, read ahead aggressively
+    BS_ADVICE_RANDOM,      // Will be read out of order, don't bother reading ahead
+    BS_ADVICE_WILLNEED,    // Will be needed soon, start loading it now
+    BS_ADVICE_DONTNEED     // Won't be needed for a while, ok to drop from memory
+} block_store_advice_t;
+
+// How a block_store gets at its backing file
+typedef enum {
+    BS_BACKEND_MMAP,   // One shared mapping of the whole file, the kernel does all the caching
+    BS_BACKEND_PREAD,  // pread/pwrite through the block_store's own block cache
+    BS_BACKEND_ASYNC   // BS_BACKEND_PREAD, plus reads run in the background on io_uring (or a thread pool without it)
+} block_store_backend_t;
+
+// Open-time options for block_store_create_config/block_store_open_config
+typedef struct {
+    block_store_backend_t backend;
+    size_t cache_blocks;  // BS_BACKEND_PREAD/ASYNC: blocks the cache holds, 0 for the default (512 KiB worth)
+    bool direct;          // BS_BACKEND_PREAD/ASYNC: open the file O_DIRECT, bypassing the kernel's page cache
+    // Geometry for block_store_create_config, opening always uses what the file was created with
+    size_t block_size;   // power of two, 512 to 64 KiB, 0 for the default
+    size_t block_count;  // up to 2^32, 0 for the default
+    // BS_BACKEND_MMAP: fault the whole image in at open, so the first touch of a block doesn't stall
+    //  (the other backends just start reading the file into the page cache)
+    bool prefault;
+    bool huge_pages;  // BS_BACKEND_MMAP: ask for transparent huge pages on the data area, for fewer TLB misses
+    // Give released blocks' space back to the host filesystem by punching holes over them
+    //  Releases are batched into runs, punched once enough pile up and at flush/close
+    bool discard;
+    // BS_BACKEND_PREAD/ASYNC, block_store_create_config/block_store_create_anon_config: store blocks compressed,
+    //  packed into a log in the file, with the cache holding them decompressed. Opening picks it up from the file,
+    //  and reads compressed stores through the pread backend whatever was asked for
+    bool compress;
+} block_store_config_t;
+
+// A finished block_store_read_async, as handed back by block_store_poll
+typedef struct {
+    uint64_t tag;  // whatever was passed to block_store_read_async
+    bool success;
+} block_store_completion_t;
+
 ///
 /// Creates a new block_store file at the specified location
 ///  and returns a block_store object linked to it
@@ -27,19 +83,192 @@ block_store_t *block_store_create(const char *const fname);
 ///
 block_store_t *block_store_open(const char *const fname);
 
+///
+/// Creates a new block_store file at the specified location, using the given backend options and geometry
+/// \param fname the file to create
+/// \param config the options to use, NULL for the defaults (same as block_store_create)
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_config(const char *const fname, const block_store_config_t *const config);
+
+///
+/// Opens the specified block_store file, using the given backend options
+///  Either backend can open a file created by the other
+/// \param fname the file to open
+/// \param config the options to use, NULL for the defaults (same as block_store_open)
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_open_config(const char *const fname, const block_store_config_t *const config);
+
+///
+/// Creates a new block_store that lives only in memory, for scratch and test volumes
+///  Nothing is zeroed up front: untouched blocks read as zeroes and take up no memory
+///  It's gone once closed, unless saved with block_store_persist
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_anon(void);
+
+///
+/// Creates a new in-memory block_store, using the given backend options and geometry
+/// \param config the options to use (direct isn't allowed), NULL for the defaults (same as block_store_create_anon)
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_anon_config(const block_store_config_t *const config);
+
+///
+/// Creates a new block_store striped across several files, for spreading I/O over more than one device
+///  Blocks go round-robin in units of stripe_blocks: the first unit to the first file, the next to the second, ...
+///  Each file gets its own geometry record, so the set has to be opened again in the same order
+///  The mmap backend can't map several files as one image, so a striped store needs pread or async
+/// \param fnames the files to create, at least two
+/// \param count the number of files
+/// \param stripe_blocks blocks per stripe unit, 0 for 64KiB worth
+/// \param config the options to use (the backend can't be mmap), NULL for the async backend's defaults
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_striped(const char *const *const fnames, const size_t count,
+                                          const size_t stripe_blocks, const block_store_config_t *const config);
+
+///
+/// Opens a block_store striped across several files, as made by block_store_create_striped
+/// \param fnames the files to open, in the order they were created in
+/// \param count the number of files
+/// \param config the options to use (the backend can't be mmap), NULL for the async backend's defaults
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_open_striped(const char *const *const fnames, const size_t count,
+                                        const block_store_config_t *const config);
+
+///
+/// Saves a copy of a block_store to a file, which block_store_open can then open
+///  Works on any block_store, and leaves it as it was. Runs of zeroes are left as holes in the copy
+/// \param bs the block_store to save
+/// \param fname the file to save to, replaced if it exists
+/// \return bool indicating success (the copy is synced to disk when it returns)
+///
+bool block_store_persist(block_store_t *const bs, const char *const fname);
+
+///
+/// Takes a snapshot of a block_store, frozen as it is right now
+///  Nothing is copied up front. From then on, each block is copied off the first time it's about to change,
+///  so a snapshot costs one block per block changed while it's open
+///  Snapshots are used from the same thread as their block_store, like the block_store itself
+/// \param bs the block_store to snapshot
+/// \return the snapshot, NULL on error
+///
+block_store_snapshot_t *block_store_snapshot(block_store_t *const bs);
+
+///
+/// Reads a block as it was when the snapshot was taken
+/// \param snap the snapshot to read from
+/// \param block_id the block to read, FBM blocks included
+/// \param dst the buffer to write to
+/// \return bool indicating success
+///
+bool block_store_snapshot_read(block_store_snapshot_t *const snap, const unsigned block_id, void *const dst);
+
+///
+/// Saves the snapshot's view of the image to a file, like block_store_persist
+/// \param snap the snapshot to save
+/// \param fname the file to save to, replaced if it exists
+/// \return bool indicating success (the copy is synced to disk when it returns)
+///
+bool block_store_snapshot_persist(block_store_snapshot_t *const snap, const char *const fname);
+
+///
+/// Closes and frees a snapshot, its block_store stops copying blocks for it
+///  Snapshots still open when their block_store is closed can only be closed after that
+/// \param snap the snapshot to close
+///
+void block_store_snapshot_close(block_store_snapshot_t *const snap);
+
+///
+/// Gets the size of the blocks in a block_store
+/// \param bs the block_store to query
+/// \return the block size in bytes, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs);
+
+///
+/// Gets the number of blocks in a block_store, FBM blocks included
+/// \param bs the block_store to query
+/// \return the block count, 0 on error
+///
+size_t block_store_get_block_count(const block_store_t *const bs);
+
+///
+/// Gets the number of page faults a block_store took at open because of block_store_config_t.prefault,
+///  each one a fault that later accesses won't have to take
+/// \param bs the block_store to query
+/// \return the prefaulted page count, 0 if it wasn't prefaulted or on error
+///
+size_t block_store_get_prefaulted(const block_store_t *const bs);
+
+///
+/// Returns how much of its file a block_store takes up
+///  That's the whole image, unless it's compressed, in which case it's the log of compressed blocks
+///  (space freed by overwrites and discards included, until a flush gets around to compacting it)
+/// \param bs the block_store to query
+/// \return the number of bytes, 0 on error
+///
+size_t block_store_get_stored_bytes(const block_store_t *const bs);
+
+///
+/// Gets the number of free blocks, without scanning the FBM
+/// \param bs the block_store to query
+/// \return the free block count, 0 on error
+///
+size_t block_store_free_count(const block_store_t *const bs);
+
+///
+/// Gets the number of blocks in use, FBM blocks included, without scanning the FBM
+/// \param bs the block_store to query
+/// \return the used block count, 0 on error
+///
+size_t block_store_used_count(const block_store_t *const bs);
+
+///
+/// Gets the length of the longest run of free blocks
+///  This one does have to walk the FBM's free space
+/// \param bs the block_store to query
+/// \return the length of the longest run, 0 if nothing is free or on error
+///
+size_t block_store_largest_free_extent(const block_store_t *const bs);
+
 ///
 /// Closes and frees a block_store object
+///  Waits out any async reads still running, and writes back anything still in the cache
 /// \param bs block_store to close
 ///
 void block_store_close(block_store_t *const bs);
 
 ///
 /// Allocates a block of storage in the block_store
+///  Allocation is next-fit: the search starts just past the last block allocated
 /// \param bs the block_store to allocate from
 /// \return id of the allocated block, 0 on error
 ///
 unsigned block_store_allocate(block_store_t *const bs);
 
+///
+/// Allocates the first free block at or after the given hint
+///  (wrapping around to the start if there isn't one)
+/// \param bs the block_store to allocate from
+/// \param hint block id to start looking at, usually one past a block you want to be next to
+/// \return id of the allocated block, 0 on error
+///
+unsigned block_store_allocate_near(block_store_t *const bs, const unsigned hint);
+
+///
+/// Allocates multiple blocks, as one contiguous run if a free one is big enough
+///  otherwise handed out as runs of adjacent ids where possible
+/// \param bs the block_store to allocate from
+/// \param count the number of blocks wanted
+/// \param out_ids array of at least count entries to receive the block ids, in allocation order
+/// \return number of blocks allocated (less than count only if the block_store filled up)
+///
+size_t block_store_allocate_extent(block_store_t *const bs, const size_t count, unsigned *const out_ids);
+
 ///
 /// Requests the allocation of a specified block id
 /// \param bs block_store to allocate from
@@ -48,13 +277,43 @@ unsigned block_store_allocate(block_store_t *const bs);
 ///
 bool block_store_request(block_store_t *const bs, const unsigned block_id);
 
+///
+/// Requests the allocation of every block in a range, whole bitmap words at a time
+///  All or nothing, if any block in the range is already allocated none of them are claimed
+/// \param bs block_store to allocate from
+/// \param first the first block to allocate
+/// \param count the number of blocks to allocate
+/// \return bool indicating the range was valid, free, and allocated
+///
+bool block_store_request_range(block_store_t *const bs, const unsigned first, const unsigned count);
+
 ///
 /// Releases the specified block id so it may be used later
+///  In discard mode its contents are dropped, it reads as zeroes once the batch it's in gets punched
 /// \param bs block_store object
 /// \param block_id block to release
 ///
 void block_store_release(block_store_t *const bs, const unsigned block_id);
 
+///
+/// Releases a list of block ids, runs of consecutive ids a whole run at a time
+///  Invalid ids are skipped
+/// \param bs block_store object
+/// \param block_ids the blocks to release
+/// \param count the number of ids in block_ids
+/// \return the number of blocks released, 0 on error
+///
+size_t block_store_release_many(block_store_t *const bs, const unsigned *const block_ids, const size_t count);
+
+///
+/// Releases every block in a range, whole bitmap words at a time
+/// \param bs block_store object
+/// \param first the first block to release
+/// \param count the number of blocks to release
+/// \return bool indicating the range was valid and released
+///
+bool block_store_release_range(block_store_t *const bs, const unsigned first, const unsigned count);
+
 ///
 /// Reads data from the specified block to the given data buffer
 /// \param bs the object to read from
@@ -73,6 +332,126 @@ bool block_store_read(block_store_t *const bs, const unsigned block_id, void *co
 ///
 bool block_store_write(block_store_t *const bs, const unsigned block_id, const void *const src);
 
+///
+/// Reads multiple blocks into one contiguous buffer
+///  Runs of adjacent block ids are copied in bulk
+///  BS_BACKEND_ASYNC has every run in flight at once
+/// \param bs the object to read from
+/// \param block_ids the blocks to read, in buffer order
+/// \param count the number of blocks to read
+/// \param dst the buffer to write to (count blocks long)
+/// \return number of blocks read, stopping at the first invalid id (less than count on error)
+///
+size_t block_store_readv(block_store_t *const bs, const unsigned *const block_ids, const size_t count, void *const dst);
+
+///
+/// Writes multiple blocks from one contiguous buffer
+///  Runs of adjacent block ids are copied in bulk
+/// \param bs the object to write to
+/// \param block_ids the blocks to write, in buffer order
+/// \param count the number of blocks to write
+/// \param src the buffer to read from (count blocks long)
+/// \return number of blocks written, stopping at the first invalid id (less than count on error)
+///
+size_t block_store_writev(block_store_t *const bs, const unsigned *const block_ids, const size_t count,
+                          const void *const src);
+
+///
+/// Gets direct, read-only access to the specified block, no copying involved
+///  Pair every successful call with block_store_unmap_block
+///  (BS_BACKEND_PREAD/ASYNC keep the block pinned in their cache until then)
+/// \param bs the object to access
+/// \param block_id the block to access
+/// \return pointer to the block's contents (one block long), NULL on error
+///
+const void *block_store_map_block(block_store_t *const bs, const unsigned block_id);
+
+///
+/// Gets direct, writable access to the specified block, for updating it in place
+///  Pair every successful call with block_store_unmap_block, flagging it dirty if you wrote to it
+/// \param bs the object to access
+/// \param block_id the block to access
+/// \return pointer to the block's contents (one block long), NULL on error
+///
+void *block_store_map_block_writable(block_store_t *const bs, const unsigned block_id);
+
+///
+/// Finishes with a block from block_store_map_block/block_store_map_block_writable
+///  The pointer must not be used afterwards
+/// \param bs the object the block came from
+/// \param block_id the block that was mapped
+/// \param dirty whether the block was modified through the pointer
+///
+void block_store_unmap_block(block_store_t *const bs, const unsigned block_id, const bool dirty);
+
+///
+/// Tells the block_store how a range of blocks is about to be used
+///  so it can read ahead (or not) accordingly. Purely a hint, contents are unaffected
+///  The block_store starts out treating everything past the FBM as BS_ADVICE_RANDOM
+/// \param bs the object to advise
+/// \param first the first block in the range
+/// \param count the number of blocks in the range
+/// \param advice the expected access pattern
+/// \return bool indicating the hint was applied
+///
+bool block_store_advise(block_store_t *const bs, const unsigned first, const unsigned count,
+                        const block_store_advice_t advice);
+
+///
+/// Starts reading a block into the given buffer without waiting for it
+///  Reads are queued and go out together on the next block_store_poll
+///  Only BS_BACKEND_ASYNC reads in the background, the others finish the read before returning
+/// \param bs the object to read from
+/// \param block_id the block to read from
+/// \param dst the buffer to write to, must stay valid until the read comes back from block_store_poll
+/// \param tag anything, handed back with the completion to identify it
+/// \return bool indicating the read was queued (false also when 64 reads are already waiting to be polled)
+///
+bool block_store_read_async(block_store_t *const bs, const unsigned block_id, void *const dst, const uint64_t tag);
+
+///
+/// Submits all queued async reads and collects the ones that have finished
+/// \param bs the object the reads were queued on
+/// \param completions array to receive the finished reads
+/// \param max the number of entries in completions
+/// \param wait true to block until at least one read finishes (unless none are outstanding)
+/// \return number of completions filled in
+///
+size_t block_store_poll(block_store_t *const bs, block_store_completion_t *const completions, const size_t max,
+                        const bool wait);
+
+///
+/// Writes all blocks modified since their last flush back to the backing file
+///  Without this, changes reach the file whenever the kernel gets around to it
+///  In discard mode, released blocks that are still free get punched out first
+///  Compressed stores only commit their block map on a synchronous flush (or block_store_sync, or close)
+/// \param bs the object to flush
+/// \param async true to only start the writeback, false to wait for it to finish
+/// \return bool indicating success
+///
+bool block_store_flush(block_store_t *const bs, const bool async);
+
+///
+/// Writes modified blocks in the given range back to the backing file
+///  Only pages holding dirty blocks are written, in as few calls as possible
+///  In discard mode, released blocks in the range get punched out too
+/// \param bs the object to flush
+/// \param first the first block in the range (FBM blocks included)
+/// \param count the number of blocks in the range
+/// \param async true to only start the writeback, false to wait for it to finish
+/// \return bool indicating success
+///
+bool block_store_flush_range(block_store_t *const bs, const unsigned first, const unsigned count, const bool async);
+
+///
+/// Waits for everything already written back to the backing file to reach the disk
+///  Lets a batch of async flushes (block_store_flush_range with async set) share one sync at the end
+///  Blocks that haven't been flushed aren't written, they're left for the next flush
+/// \param bs the object to sync
+/// \return bool indicating success
+///
+bool block_store_sync(block_store_t *const bs);
+
 #ifdef __cplusplus
 }
 #endif
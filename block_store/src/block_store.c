@@ -2,83 +2,1477 @@
 
 #include <bitmap.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+// Dragged in through linux/fs.h, and not the block size we mean
+#undef BLOCK_SIZE
+#endif
 
-#define BLOCK_COUNT 65536
-#define BLOCK_SIZE 512
-#define FBM_BLOCK_COUNT 16
-#define BYTE_TOTAL ((BLOCK_COUNT) * (BLOCK_SIZE))
-#define DATA_BLOCK_BYTE_TOTAL ((65536 - (FBM_BLOCK_COUNT)) * (BLOCK_SIZE))
-#define FBM_BYTE_TOTAL ((BLOCK_SIZE) * (FBM_BLOCK_COUNT))
-#define DATA_BLOCK_START (FBM_BLOCK_COUNT)
+// Geometry limits, block sizes are powers of two in between
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+#define BLOCK_COUNT_MAX (1ULL << 32)
+// The store is blocks [0, fbm_blocks) of FBM, then data
+#define IMAGE_BYTES(bs) ((bs)->block_count * (bs)->block_size)
+#define FBM_BYTES(bs) ((bs)->fbm_blocks * (bs)->block_size)
+#define DATA_BYTES(bs) (IMAGE_BYTES(bs) - FBM_BYTES(bs))
+// FBM block that holds the given block's bit
+#define FBM_BLOCK_OF(bs, block_id) ((block_id) / ((bs)->block_size * 8))
 
+// Data blocks are [fbm_blocks, block_count)
+// One unsigned compare covers both ends, ids under fbm_blocks wrap around to something huge
+#define BLOCK_IN_RANGE(bs, block_id) ((size_t)(block_id) - (bs)->fbm_blocks < (bs)->block_count - (bs)->fbm_blocks)
+
+// Checked builds (BLOCK_STORE_CHECKED) also want the block allocated before it's read, written,
+// mapped or released, and say so on stderr when it isn't. That's only a report: the access still goes ahead,
+// so return values are the same as an unchecked build and it's just the range check that can fail it
+#ifdef BLOCK_STORE_CHECKED
+#define BLOCK_ACCESSIBLE(bs, block_id) (block_check((bs), (block_id), __func__))
+#else
+#define BLOCK_ACCESSIBLE(bs, block_id) BLOCK_IN_RANGE(bs, block_id)
+#endif
+
+// pread backend cache: set associative, CACHE_WAYS blocks per set
+#define CACHE_WAYS 4
+#define CACHE_DEFAULT_BYTES (512 * 1024)
+// Buffer alignment that keeps O_DIRECT happy on anything we'd run on
+#define IO_ALIGNMENT 4096
+
+typedef struct {
+    unsigned block_id;   // 0 when empty, block 0 is FBM so it never gets cached
+    unsigned pins;       // outstanding block_store_map_block calls, pinned slots can't be evicted
+    uint64_t last_used;  // cache clock at last use, lowest in the set gets evicted
+} cache_slot_t;
+
+// Async reads in flight at once, also the io_uring queue size
+#define ASYNC_DEPTH 64
+// Threads reading for the fallback when io_uring isn't available
+#define ASYNC_WORKERS 4
+
+typedef struct {
+    uint8_t *dst;
+    size_t first, count;  // blocks, never crossing into another file
+    int fd;
+    off_t offset;         // where first is in fd
+    uint64_t tag;         // the caller's, or for readv the request's offset into its block list
+    bool internal;        // issued by readv, waited on there instead of going through block_store_poll
+    bool success;
+    struct iovec iov;     // READV needs this to stay put until it completes
+} async_request_t;
+
+#ifdef HAVE_IO_URING
+// Just enough of an io_uring to push reads through, straight on the syscalls
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;  // queued in the SQ but not handed to the kernel yet
+} uring_t;
+#endif
+
+// Requests live in fixed slots, and only the slot index goes through io_uring/the workers and back
+// Everything below the lock is shared with the workers
+typedef struct {
+    bool uring;                        // io_uring is up, else the workers are
+    async_request_t requests[ASYNC_DEPTH];
+    unsigned free_slots[ASYNC_DEPTH];  // stack of unused slot indices
+    size_t free_count;
+    unsigned queued[ASYNC_DEPTH];      // workers only: waiting for the next submission
+    size_t queued_count;
+    size_t user_pending;               // block_store_read_async requests not yet returned by block_store_poll
+    size_t in_flight;                  // handed to io_uring/the workers, not yet completed
+    size_t internal_pending;           // readv requests not yet completed
+    size_t internal_failed;            // lowest failed readv tag, SIZE_MAX if none
+#ifdef HAVE_IO_URING
+    uring_t ring;
+#endif
+    pthread_t workers[ASYNC_WORKERS];
+    unsigned worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready, work_done;
+    bool stop;
+    unsigned work[ASYNC_DEPTH];  // ring of slots for the workers to pick up
+    size_t work_head, work_count;
+    unsigned done[ASYNC_DEPTH];  // ring of completed slots for block_store_poll
+    size_t done_head, done_count;
+} async_engine_t;
+
+// Geometry record, kept at the very end of the file after the last block
+// At the end rather than the start so block offsets stay plain multiples of the block size (and page aligned)
+// and images from before it existed (the default geometry, and nothing past the last block) still open
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t block_count;
+} geometry_record_t;
+
+#define GEOMETRY_MAGIC 0x3130454F4547534BULL
+#define GEOMETRY_VERSION 1
+
+// Striped stores spread their blocks over several files, a stripe unit at a time round-robin
+// Each file ends with this instead, with its own magic so one can't be opened as a store on its own
+typedef struct {
+    geometry_record_t geometry;  // the whole store's
+    uint32_t stripe_index;       // which file this is
+    uint32_t stripe_count;
+    uint64_t stripe_blocks;      // blocks per stripe unit
+} stripe_record_t;
+
+#define STRIPE_MAGIC 0x3130455049525453ULL
+// Stripe unit when block_store_create_striped isn't given one
+#define STRIPE_DEFAULT_BYTES (64 * 1024)
+
+// Compressed stores start with this instead, and the rest of the file is a log of compressed block records
+// At the front since nothing in the log is block aligned anyway, and a plain store's first byte always has
+// the FBM's own bit set where the magic's has it clear, so one can't be taken for the other
+// Flushes write the map of where every block's record is into the log as well, and only then point this at it
+typedef struct {
+    geometry_record_t geometry;
+    uint64_t map_offset;  // 0 if no map has been written yet, every block reads as zeroes
+    uint64_t log_end;     // the map ends the log, at least as far as this record knows
+    uint64_t log_dead;    // bytes in the log that nothing points at any more
+} packed_record_t;
+
+#define PACKED_MAGIC 0x313044454B434150ULL
+// Map entries are the record's offset in the file over its length, 0 for a block without one (all zeroes)
+// A record as long as the block is the block as-is, it didn't compress
+#define PACKED_LENGTH_BITS 17
+#define PACKED_ENTRY(offset, length) (((uint64_t) (offset) << PACKED_LENGTH_BITS) | (length))
+#define PACKED_OFFSET(entry) ((off_t) ((entry) >> PACKED_LENGTH_BITS))
+#define PACKED_LENGTH(entry) ((size_t) ((entry) & ((1ULL << PACKED_LENGTH_BITS) - 1)))
+// Flushes slide the live records down over the dead ones once there's at least this much dead, and more dead than live
+#define PACKED_COMPACT_MIN (4 * 1024 * 1024)
+
+// Block compression is LZ4-style: each sequence is a token (literal count << 4 | match length - PACK_MIN_MATCH,
+// 15 in either meaning more follows in bytes), the literals, then the match's 2 byte offset back
+// The last sequence is just literals. Matches are found through a hash table of PACK_HASH_BITS
+#define PACK_MIN_MATCH 4
+#define PACK_HASH_BITS 12
+
+// Discard mode punches released blocks out once this many have piled up
+#define DISCARD_BATCH 1024
+
+// block_store_persist copies this much at a time, and leaves all-zero chunks as holes
+#define PERSIST_CHUNK (64 * 1024)
+
+// Where block_store_init gets its backing file from
+typedef enum { STORE_OPEN, STORE_CREATE, STORE_CREATE_ANON } store_origin_t;
 
 struct block_store {
     int fd;
+    // Block b is in stripe unit b / stripe_blocks, and the units go round-robin over the files
+    // A store that isn't striped is one file with a single unit covering everything
+    int *stripe_fds;  // stripe_fds[0] is fd, and a store that isn't striped just points at fd
+    size_t stripe_count;
+    size_t stripe_blocks;
+    size_t block_size;
+    size_t block_count;
+    size_t fbm_blocks;  // also the first data block
+    block_store_backend_t backend;
     bitmap_t *fbm;
-    uint8_t *data_blocks;
+    uint8_t *data_blocks;  // mmap: the whole image, pread: just the FBM blocks
+    size_t alloc_cursor;   // next-fit: where the next allocation starts looking
+    size_t used_blocks;    // bits set in the FBM, FBM blocks included, kept current by fbm_claim/fbm_free
+    bitmap_t *dirty;       // blocks changed since they were last flushed (pread: cached blocks not yet written)
+    bitmap_t *released;    // discard mode: blocks released since the last punch, NULL when not discarding
+    size_t released_count; // may overcount after range releases, it only decides when a batch is due
+    // pread backend only
+    size_t prefaulted;     // page faults taken at open so later accesses don't have to
+    bool direct;           // opened O_DIRECT, everything has to go through aligned cache buffers
+    cache_slot_t *slots;   // cache_sets * CACHE_WAYS, set by set
+    uint8_t *cache;        // block contents for each slot
+    size_t cache_sets;
+    uint64_t cache_clock;
+    async_engine_t async;
+    block_store_snapshot_t *snapshots;  // live snapshots, each gets a block's old contents before it changes
+    // Compressed stores only, packed_map is NULL otherwise
+    uint64_t *packed_map;  // every block's PACKED_ENTRY
+    uint8_t *pack_buffer;  // a block's worth of room for records on their way to or from the log
+    uint64_t map_offset;   // where the map was last written, 0 if it hasn't been
+    uint64_t log_end;      // the next record goes here
+    uint64_t log_dead;     // bytes of records (and old maps) that nothing points at any more
+    bool map_changed;      // the map has moved on from the one in the file
 };
 
-int create_file(const char *const fname) {
+// A frozen view of a block_store: blocks changed since it was taken are copied off into fd first,
+// everything else is still the same in the origin and gets read from there
+struct block_store_snap {
+    block_store_t *origin;  // NULL once the origin has been closed
+    block_store_snapshot_t *next;
+    int fd;               // memfd laid out like the image, only preserved blocks are ever written to it
+    bitmap_t *preserved;  // blocks copied off into fd
+    uint8_t *buffer;      // one aligned block for copies to go through
+    bool broken;          // a copy failed, so the view can't be trusted any more
+};
+
+#ifdef BLOCK_STORE_CHECKED
+static bool block_check(const block_store_t *const bs, const size_t block_id, const char *const caller) {
+    if (!BLOCK_IN_RANGE(bs, block_id)) {
+        fprintf(stderr, "[!] %s: block %zu is out of range [%zu, %zu)\n", caller, block_id, bs->fbm_blocks,
+                bs->block_count);
+        return false;
+    }
+    if (!bitmap_test(bs->fbm, block_id)) {
+        fprintf(stderr, "[!] %s: block %zu isn't allocated\n", caller, block_id);
+    }
+    return true;
+}
+#endif
+
+static void cow_preserve(block_store_t *const bs, const size_t block_id);
+
+// FBM changes go through here so the FBM block they land in gets flagged for flushing
+// and used_blocks stays right. Claims are only ever made on blocks known to be free
+static inline void fbm_claim(block_store_t *const bs, const size_t block_id) {
+    cow_preserve(bs, FBM_BLOCK_OF(bs, block_id));
+    bitmap_set(bs->fbm, block_id);
+    bitmap_set(bs->dirty, FBM_BLOCK_OF(bs, block_id));
+    ++bs->used_blocks;
+}
+
+// Range version of fbm_claim, every block in the range is known to be free
+static inline void fbm_claim_range(block_store_t *const bs, const size_t first, const size_t count) {
+    for (size_t block = FBM_BLOCK_OF(bs, first); block <= FBM_BLOCK_OF(bs, first + count - 1) && bs->snapshots; ++block) {
+        cow_preserve(bs, block);
+    }
+    bitmap_set_range(bs->fbm, first, count);
+    bitmap_set_range(bs->dirty, FBM_BLOCK_OF(bs, first), FBM_BLOCK_OF(bs, first + count - 1) - FBM_BLOCK_OF(bs, first) + 1);
+    bs->used_blocks += count;
+}
+
+static inline void fbm_free(block_store_t *const bs, const size_t block_id) {
+    cow_preserve(bs, FBM_BLOCK_OF(bs, block_id));
+    if (bitmap_test(bs->fbm, block_id)) {
+        --bs->used_blocks;
+    }
+    bitmap_reset(bs->fbm, block_id);
+    bitmap_set(bs->dirty, FBM_BLOCK_OF(bs, block_id));
+}
+
+static inline void fbm_free_range(block_store_t *const bs, const size_t first, const size_t count) {
+    for (size_t block = FBM_BLOCK_OF(bs, first); block <= FBM_BLOCK_OF(bs, first + count - 1) && bs->snapshots; ++block) {
+        cow_preserve(bs, block);
+    }
+    bs->used_blocks -= bitmap_range_count(bs->fbm, first, count);
+    bitmap_reset_range(bs->fbm, first, count);
+    bitmap_set_range(bs->dirty, FBM_BLOCK_OF(bs, first), FBM_BLOCK_OF(bs, first + count - 1) - FBM_BLOCK_OF(bs, first) + 1);
+}
+
+static bool geometry_valid(const size_t block_size, const uint64_t block_count) {
+    return block_size >= BLOCK_SIZE_MIN && block_size <= BLOCK_SIZE_MAX && !(block_size & (block_size - 1))
+           && block_count <= BLOCK_COUNT_MAX && block_count > BLOCK_STORE_FBM_BLOCKS(block_size, block_count);
+}
+
+// The geometry record goes through a plain descriptor since O_DIRECT can't do small unaligned I/O
+// so swap to one with the requested flags once it's done with
+static int reopen_file(const int fd, const char *const fname, const int flags) {
+    if (!flags) {
+        return fd;
+    }
+    const int flagged_fd = open(fname, O_RDWR | flags);
+    close(fd);
+    return flagged_fd;
+}
+
+// Reformatting an existing file needs no wiping or hole punching either, O_TRUNC drops every block it had
+int create_file(const char *const fname, const int flags, const geometry_record_t *const geometry) {
     if (fname) {
         int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
-            if (ftruncate(fd, BYTE_TOTAL) != -1) {
-                return fd;
+            const off_t image_bytes = (off_t) geometry->block_size * geometry->block_count;
+            if (ftruncate(fd, image_bytes + sizeof(geometry_record_t)) != -1
+                && pwrite(fd, geometry, sizeof(geometry_record_t), image_bytes) == sizeof(geometry_record_t)) {
+                return reopen_file(fd, fname, flags);
+            }
+            close(fd);
+        }
+    }
+    return -1;
+}
+int check_file(const char *const fname, const int flags, geometry_record_t *const geometry) {
+    if (fname) {
+        int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd != -1) {
+            struct stat file_info;
+            packed_record_t packed;
+            if (pread(fd, &packed, sizeof(packed), 0) == sizeof(packed) && packed.geometry.magic == PACKED_MAGIC) {
+                // Compressed, geometry->magic tells the caller so. O_DIRECT can't do the log's unaligned records
+                if (packed.geometry.version == GEOMETRY_VERSION
+                    && geometry_valid(packed.geometry.block_size, packed.geometry.block_count) && !flags) {
+                    *geometry = packed.geometry;
+                    return fd;
+                }
+            } else if (fstat(fd, &file_info) != -1) {
+                const off_t record_at = file_info.st_size - (off_t) sizeof(geometry_record_t);
+                if (record_at > 0 && pread(fd, geometry, sizeof(geometry_record_t), record_at) == sizeof(geometry_record_t)
+                    && geometry->magic == GEOMETRY_MAGIC && geometry->version == GEOMETRY_VERSION
+                    && geometry_valid(geometry->block_size, geometry->block_count)
+                    && (off_t) (geometry->block_size * geometry->block_count) == record_at) {
+                    return reopen_file(fd, fname, flags);
+                }
+                if (file_info.st_size
+                    == (off_t) BLOCK_STORE_DEFAULT_BLOCK_SIZE * BLOCK_STORE_DEFAULT_BLOCK_COUNT) {
+                    // From before geometry was recorded, so it can only be the default
+                    geometry->magic       = GEOMETRY_MAGIC;
+                    geometry->block_size  = BLOCK_STORE_DEFAULT_BLOCK_SIZE;
+                    geometry->block_count = BLOCK_STORE_DEFAULT_BLOCK_COUNT;
+                    return reopen_file(fd, fname, flags);
+                }
+            }
+            close(fd);
+        }
+    }
+    return -1;
+}
+
+// Bytes of data a striped store's file holds, its share of the stripe units
+static off_t stripe_bytes(const stripe_record_t *const record) {
+    const uint64_t units        = (record->geometry.block_count + record->stripe_blocks - 1) / record->stripe_blocks;
+    const uint64_t member_units = (units - record->stripe_index + record->stripe_count - 1) / record->stripe_count;
+    return (off_t) (member_units * record->stripe_blocks * record->geometry.block_size);
+}
+
+static int create_stripe(const char *const fname, const int flags, const stripe_record_t *const record) {
+    if (fname) {
+        int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd != -1) {
+            const off_t data_bytes = stripe_bytes(record);
+            if (ftruncate(fd, data_bytes + sizeof(stripe_record_t)) != -1
+                && pwrite(fd, record, sizeof(stripe_record_t), data_bytes) == sizeof(stripe_record_t)) {
+                return reopen_file(fd, fname, flags);
+            }
+            close(fd);
+        }
+    }
+    return -1;
+}
+
+static int check_stripe(const char *const fname, const int flags, stripe_record_t *const record) {
+    if (fname) {
+        int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd != -1) {
+            struct stat file_info;
+            if (fstat(fd, &file_info) != -1) {
+                const off_t record_at = file_info.st_size - (off_t) sizeof(stripe_record_t);
+                if (record_at > 0 && pread(fd, record, sizeof(stripe_record_t), record_at) == sizeof(stripe_record_t)
+                    && record->geometry.magic == STRIPE_MAGIC && record->geometry.version == GEOMETRY_VERSION
+                    && geometry_valid(record->geometry.block_size, record->geometry.block_count)
+                    && record->stripe_blocks && record->stripe_index < record->stripe_count
+                    && stripe_bytes(record) == record_at) {
+                    return reopen_file(fd, fname, flags);
+                }
+            }
+            close(fd);
+        }
+    }
+    return -1;
+}
+
+// Creates or opens every file of a striped store, in order, and checks they all belong to the same one
+// Sets bs->fd to the first on success
+static bool open_stripes(block_store_t *const bs, const bool init, const char *const *const fnames,
+                         const size_t file_count, const size_t stripe_blocks, const int flags,
+                         geometry_record_t *const geometry) {
+    bs->stripe_fds = (int *) malloc(file_count * sizeof(int));
+    if (bs->stripe_fds) {
+        stripe_record_t first;
+        memset(&first, 0, sizeof(first));
+        for (bs->stripe_count = 0; bs->stripe_count < file_count; ++bs->stripe_count) {
+            stripe_record_t record = {{STRIPE_MAGIC, GEOMETRY_VERSION, geometry->block_size, geometry->block_count},
+                                      (uint32_t) bs->stripe_count, (uint32_t) file_count, stripe_blocks};
+            const int fd = init ? create_stripe(fnames[bs->stripe_count], flags, &record)
+                                : check_stripe(fnames[bs->stripe_count], flags, &record);
+            if (fd == -1) {
+                break;
+            }
+            bs->stripe_fds[bs->stripe_count] = fd;
+            if (!bs->stripe_count) {
+                first = record;
+            }
+            if (record.stripe_index != bs->stripe_count || record.stripe_count != file_count
+                || record.stripe_blocks != first.stripe_blocks || record.geometry.block_size != first.geometry.block_size
+                || record.geometry.block_count != first.geometry.block_count) {
+                ++bs->stripe_count;
+                break;
+            }
+        }
+        if (bs->stripe_count == file_count) {
+            *geometry         = first.geometry;
+            bs->stripe_blocks = first.stripe_blocks;
+            bs->fd            = bs->stripe_fds[0];
+            return true;
+        }
+        while (bs->stripe_count) {
+            close(bs->stripe_fds[--bs->stripe_count]);
+        }
+        free(bs->stripe_fds);
+    }
+    return false;
+}
+
+static void close_files(block_store_t *const bs) {
+    for (size_t idx = 0; idx < bs->stripe_count; ++idx) {
+        close(bs->stripe_fds[idx]);
+    }
+    if (bs->stripe_fds != &bs->fd) {
+        free(bs->stripe_fds);
+    }
+}
+
+// Memory-only backing: a memfd, whose pages read as zero until written and only take up memory once they are
+static int create_anon(const geometry_record_t *const geometry) {
+    const int fd = memfd_create("block_store", MFD_CLOEXEC);
+    if (fd != -1) {
+        if (ftruncate(fd, (off_t) geometry->block_size * geometry->block_count) != -1) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// Compressed stores start out as just the header: an empty log, and no map yet
+static int create_packed(const char *const fname, const geometry_record_t *const geometry) {
+    const int fd = fname ? open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+                         : memfd_create("block_store", MFD_CLOEXEC);
+    if (fd != -1) {
+        const packed_record_t record = {
+            {PACKED_MAGIC, GEOMETRY_VERSION, geometry->block_size, geometry->block_count}, 0, sizeof(packed_record_t), 0};
+        if (pwrite(fd, &record, sizeof(record), 0) == sizeof(record)) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// Marks the FBM's own blocks as in use, straight in the raw FBM since it isn't overlaid yet
+static void reserve_fbm(block_store_t *const bs) {
+    memset(bs->data_blocks, 0xFF, bs->fbm_blocks >> 3);
+    if (bs->fbm_blocks & 7) {
+        bs->data_blocks[bs->fbm_blocks >> 3] = (uint8_t) ((1 << (bs->fbm_blocks & 7)) - 1);
+    }
+}
+
+// Moves a whole buffer to/from the file, picking up after short transfers and signals
+static bool file_io(const int fd, const bool write, void *const buffer, const size_t length, const off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t res = write ? pwrite(fd, (uint8_t *) buffer + done, length - done, offset + done)
+                                  : pread(fd, (uint8_t *) buffer + done, length - done, offset + done);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+static inline uint32_t pack_load32(const uint8_t *const src) {
+    uint32_t value;
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+// The part of a length that didn't fit in its token nibble, as bytes of 255 and a last one under that
+static bool pack_put_length(uint8_t *const dst, size_t *const out, const size_t limit, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (*out == limit) {
+            return false;
+        }
+        dst[(*out)++] = 255;
+    }
+    if (*out == limit) {
+        return false;
+    }
+    dst[(*out)++] = (uint8_t) length;
+    return true;
+}
+
+static bool pack_get_length(const uint8_t *const src, size_t *const in, const size_t length, size_t *const value) {
+    uint8_t byte;
+    do {
+        if (*in == length) {
+            return false;
+        }
+        byte = src[(*in)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Appends a sequence, match_length 0 for the last one
+static bool pack_sequence(uint8_t *const dst, size_t *const out, const size_t limit, const uint8_t *const literals,
+                          const size_t literal_count, const size_t match_length, const size_t offset) {
+    const size_t match_extra = match_length ? match_length - PACK_MIN_MATCH : 0;
+    if (*out == limit) {
+        return false;
+    }
+    dst[(*out)++] = (uint8_t) (((literal_count < 15 ? literal_count : 15) << 4) | (match_extra < 15 ? match_extra : 15));
+    if ((literal_count >= 15 && !pack_put_length(dst, out, limit, literal_count - 15)) || literal_count > limit - *out) {
+        return false;
+    }
+    memcpy(dst + *out, literals, literal_count);
+    *out += literal_count;
+    if (match_length) {
+        if (limit - *out < 2) {
+            return false;
+        }
+        dst[(*out)++] = (uint8_t) offset;
+        dst[(*out)++] = (uint8_t) (offset >> 8);
+        return match_extra < 15 || pack_put_length(dst, out, limit, match_extra - 15);
+    }
+    return true;
+}
+
+// Compresses length bytes of src into at most limit bytes of dst
+// Returns the compressed length, 0 if it doesn't fit
+static size_t pack_compress(const uint8_t *const src, const size_t length, uint8_t *const dst, const size_t limit) {
+    uint32_t table[1 << PACK_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t out    = 0;
+    size_t anchor = 0;
+    size_t pos    = 0;
+    while (pos + PACK_MIN_MATCH <= length) {
+        const uint32_t sequence = pack_load32(src + pos);
+        const uint32_t hash     = (sequence * 2654435761U) >> (32 - PACK_HASH_BITS);
+        const size_t candidate  = table[hash];
+        table[hash]             = (uint32_t) pos;
+        // Empty entries say 0, which is as good a guess as any since the bytes get compared anyway
+        if (candidate < pos && pos - candidate <= 0xFFFF && pack_load32(src + candidate) == sequence) {
+            size_t match = PACK_MIN_MATCH;
+            while (pos + match < length && src[candidate + match] == src[pos + match]) {
+                ++match;
+            }
+            if (!pack_sequence(dst, &out, limit, src + anchor, pos - anchor, match, pos - candidate)) {
+                return 0;
+            }
+            pos += match;
+            anchor = pos;
+        } else {
+            ++pos;
+        }
+    }
+    return pack_sequence(dst, &out, limit, src + anchor, length - anchor, 0, 0) ? out : 0;
+}
+
+// Undoes pack_compress, false unless src comes out to exactly size bytes
+// Records come off the disk, so nothing in them is trusted to stay in bounds
+static bool pack_expand(const uint8_t *const src, const size_t length, uint8_t *const dst, const size_t size) {
+    size_t in  = 0;
+    size_t out = 0;
+    while (in < length) {
+        const uint8_t token  = src[in++];
+        size_t literal_count = token >> 4;
+        if ((literal_count == 15 && !pack_get_length(src, &in, length, &literal_count))
+            || literal_count > length - in || literal_count > size - out) {
+            return false;
+        }
+        memcpy(dst + out, src + in, literal_count);
+        in += literal_count;
+        out += literal_count;
+        if (in == length) {
+            break;
+        }
+        if (length - in < 2) {
+            return false;
+        }
+        const size_t offset = src[in] | ((size_t) src[in + 1] << 8);
+        size_t match        = token & 0x0F;
+        in += 2;
+        if ((match == 15 && !pack_get_length(src, &in, length, &match)) || !offset || offset > out
+            || match + PACK_MIN_MATCH > size - out) {
+            return false;
+        }
+        // Byte at a time, matches can overlap what they're copying
+        for (match += PACK_MIN_MATCH; match; --match, ++out) {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out == size;
+}
+
+static inline void packed_drop(block_store_t *const bs, const size_t block_id) {
+    if (bs->packed_map[block_id]) {
+        bs->log_dead += PACKED_LENGTH(bs->packed_map[block_id]);
+        bs->packed_map[block_id] = 0;
+        bs->map_changed          = true;
+    }
+}
+
+static bool packed_read(block_store_t *const bs, const size_t block_id, uint8_t *const dst) {
+    const uint64_t entry = bs->packed_map[block_id];
+    const size_t length  = PACKED_LENGTH(entry);
+    if (!length) {
+        memset(dst, 0x00, bs->block_size);
+        return true;
+    }
+    if (length == bs->block_size) {
+        return file_io(bs->fd, false, dst, length, PACKED_OFFSET(entry));
+    }
+    return file_io(bs->fd, false, bs->pack_buffer, length, PACKED_OFFSET(entry))
+           && pack_expand(bs->pack_buffer, length, dst, bs->block_size);
+}
+
+// Appends the block's new record to the log, all-zero blocks don't need one
+static bool packed_write(block_store_t *const bs, const size_t block_id, const uint8_t *const src) {
+    size_t length = 0;
+    if (src[0] || memcmp(src, src + 1, bs->block_size - 1)) {
+        length = pack_compress(src, bs->block_size, bs->pack_buffer, bs->block_size - 1);
+        const uint8_t *const record = length ? bs->pack_buffer : src;
+        length                      = length ? length : bs->block_size;
+        if (!file_io(bs->fd, true, (void *) record, length, (off_t) bs->log_end)) {
+            return false;
+        }
+    }
+    packed_drop(bs, block_id);
+    if (length) {
+        bs->packed_map[block_id] = PACKED_ENTRY(bs->log_end, length);
+        bs->log_end += length;
+        bs->map_changed = true;
+    }
+    return true;
+}
+
+// Writes map out at offset, then points the header at it. Everything from offset on has to be space the header
+// doesn't point at yet, so until the header's rewritten the file still has the last map and every record it needs
+// The map (and the records it points at) are synced before the header goes out, otherwise the header can
+// reach the disk first and point at a map that never made it. Then the header's synced too
+static bool packed_publish(block_store_t *const bs, const uint64_t *const map, const uint64_t offset,
+                           const uint64_t dead) {
+    const size_t map_bytes       = bs->block_count * sizeof(uint64_t);
+    const packed_record_t record = {
+        {PACKED_MAGIC, GEOMETRY_VERSION, (uint32_t) bs->block_size, bs->block_count}, offset, offset + map_bytes, dead};
+    if (!file_io(bs->fd, true, (void *) map, map_bytes, (off_t) offset) || fdatasync(bs->fd) != 0
+        || pwrite(bs->fd, &record, sizeof(record), 0) != sizeof(record)) {
+        return false;
+    }
+    bs->map_offset  = record.map_offset;
+    bs->log_end     = record.log_end;
+    bs->log_dead    = record.log_dead;
+    bs->map_changed = false;
+    return fdatasync(bs->fd) == 0;
+}
+
+typedef struct {
+    uint64_t entry;
+    size_t block_id;
+} packed_live_t;
+
+// Entries sort by offset, since that's in the high bits
+static int packed_live_order(const void *const left, const void *const right) {
+    const uint64_t left_entry  = ((const packed_live_t *) left)->entry;
+    const uint64_t right_entry = ((const packed_live_t *) right)->entry;
+    return left_entry < right_entry ? -1 : left_entry > right_entry;
+}
+
+// Copies the live records, in log order, into the file from cursor on and points map at the copies
+// Returns where the copies end, 0 if one of them failed
+static uint64_t packed_relocate(block_store_t *const bs, const packed_live_t *const live, const size_t live_count,
+                                uint64_t *const map, uint64_t cursor) {
+    for (size_t idx = 0; idx < live_count; ++idx) {
+        const uint64_t entry = map[live[idx].block_id];
+        const size_t length  = PACKED_LENGTH(entry);
+        if (!file_io(bs->fd, false, bs->pack_buffer, length, PACKED_OFFSET(entry))
+            || !file_io(bs->fd, true, bs->pack_buffer, length, (off_t) cursor)) {
+            return 0;
+        }
+        map[live[idx].block_id] = PACKED_ENTRY(cursor, length);
+        cursor += length;
+    }
+    return cursor;
+}
+
+// Squeezes the dead space out of the log, as a commit of its own
+// Records are never written anywhere the file's header points at: they're copied past the end of the log and
+// published there first, which leaves the whole front of the file unused, then copied down to the front and
+// published again, and only then does the file get cut back. A crash at any point leaves one map or the other
+static bool packed_compact(block_store_t *const bs) {
+    const size_t map_bytes = bs->block_count * sizeof(uint64_t);
+    size_t live_count      = 0;
+    for (size_t block = 0; block < bs->block_count; ++block) {
+        live_count += bs->packed_map[block] != 0;
+    }
+    packed_live_t *const live = (packed_live_t *) malloc((live_count + 1) * sizeof(packed_live_t));
+    uint64_t *const map       = (uint64_t *) malloc(map_bytes);
+    bool success              = live && map;
+    if (success) {
+        live_count = 0;
+        for (size_t block = 0; block < bs->block_count; ++block) {
+            if (bs->packed_map[block]) {
+                live[live_count].entry      = bs->packed_map[block];
+                live[live_count++].block_id = block;
+            }
+        }
+        qsort(live, live_count, sizeof(packed_live_t), packed_live_order);
+        memcpy(map, bs->packed_map, map_bytes);
+        // Everything up to the old end of the log is dead once the copies are published
+        const uint64_t old_end = bs->log_end;
+        uint64_t end           = packed_relocate(bs, live, live_count, map, old_end);
+        success                = end && packed_publish(bs, map, end, old_end - sizeof(packed_record_t));
+        if (success) {
+            memcpy(bs->packed_map, map, map_bytes);
+            // Failing from here on just leaves the log uncompacted, the copies past the old end are what counts
+            end = packed_relocate(bs, live, live_count, map, sizeof(packed_record_t));
+            if (end && packed_publish(bs, map, end, 0)) {
+                memcpy(bs->packed_map, map, map_bytes);
+                success = ftruncate(bs->fd, (off_t) bs->log_end) == 0;
+            }
+        }
+    }
+    free(live);
+    free(map);
+    return success;
+}
+
+// Writes the map out at the end of the log, compacting it first if it's mostly dead
+static bool packed_commit(block_store_t *const bs) {
+    if (!bs->map_changed) {
+        return true;
+    }
+    // Compacting needs the dead space to hold a map as well as the records, so they fit in front of the old end
+    const size_t map_bytes    = bs->block_count * sizeof(uint64_t);
+    const uint64_t live_bytes = bs->log_end - sizeof(packed_record_t) - bs->log_dead;
+    if (bs->log_dead >= PACKED_COMPACT_MIN && bs->log_dead > live_bytes && bs->log_dead >= map_bytes) {
+        return packed_compact(bs);
+    }
+    return packed_publish(bs, bs->packed_map, bs->log_end, bs->log_dead + (bs->map_offset ? map_bytes : 0));
+}
+
+// Loads the map the header points at, anything it says has to be inside the log before it
+// New stores just start with an empty one
+static bool packed_setup(block_store_t *const bs, const bool init) {
+    packed_record_t record = {{PACKED_MAGIC, GEOMETRY_VERSION, 0, 0}, 0, sizeof(packed_record_t), 0};
+    const size_t map_bytes = bs->block_count * sizeof(uint64_t);
+    bs->packed_map         = (uint64_t *) calloc(bs->block_count, sizeof(uint64_t));
+    bs->pack_buffer        = (uint8_t *) malloc(bs->block_size);
+    if (bs->packed_map && bs->pack_buffer && (init || pread(bs->fd, &record, sizeof(record), 0) == sizeof(record))
+        && record.log_end >= sizeof(record) && record.log_dead <= record.log_end
+        && (!record.map_offset
+            || (record.map_offset >= sizeof(record) && record.map_offset + map_bytes <= record.log_end
+                && file_io(bs->fd, false, bs->packed_map, map_bytes, (off_t) record.map_offset)))) {
+        size_t block = 0;
+        while (block < bs->block_count
+               && (!bs->packed_map[block]
+                   || (PACKED_LENGTH(bs->packed_map[block]) && PACKED_LENGTH(bs->packed_map[block]) <= bs->block_size
+                       && PACKED_OFFSET(bs->packed_map[block]) >= (off_t) sizeof(record)
+                       && PACKED_OFFSET(bs->packed_map[block]) + PACKED_LENGTH(bs->packed_map[block])
+                              <= record.map_offset))) {
+            ++block;
+        }
+        if (block == bs->block_count) {
+            bs->map_offset = record.map_offset;
+            bs->log_end    = record.log_end;
+            bs->log_dead   = record.log_dead;
+            return true;
+        }
+    }
+    free(bs->packed_map);
+    free(bs->pack_buffer);
+    bs->packed_map  = NULL;
+    bs->pack_buffer = NULL;
+    return false;
+}
+
+static void packed_release(block_store_t *const bs) {
+    free(bs->packed_map);
+    free(bs->pack_buffer);
+}
+
+// Where a block is: returns the file it's in, and sets its offset there
+// and how many blocks from it on carry on contiguously in that file (to the end of its stripe unit)
+static inline int block_locate(const block_store_t *const bs, const size_t block_id, off_t *const offset,
+                               size_t *const span) {
+    const size_t unit   = block_id / bs->stripe_blocks;
+    const size_t within = block_id % bs->stripe_blocks;
+    *offset = (off_t) (((unit / bs->stripe_count) * bs->stripe_blocks + within) * bs->block_size);
+    *span   = bs->stripe_blocks - within;
+    return bs->stripe_fds[unit % bs->stripe_count];
+}
+
+// file_io for a run of blocks, split up wherever the run moves on to another file
+// Compressed stores go a record at a time, wherever each one is in the log
+static bool block_io(block_store_t *const bs, const bool write, void *const buffer, const size_t first,
+                     const size_t count) {
+    if (bs->packed_map) {
+        for (size_t done = 0; done < count; ++done) {
+            uint8_t *const data = (uint8_t *) buffer + (bs->block_size * done);
+            if (!(write ? packed_write(bs, first + done, data) : packed_read(bs, first + done, data))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (size_t done = 0; done < count;) {
+        off_t offset;
+        size_t span;
+        const int fd = block_locate(bs, first + done, &offset, &span);
+        span         = span < count - done ? span : count - done;
+        if (!file_io(fd, write, (uint8_t *) buffer + (bs->block_size * done), bs->block_size * span, offset)) {
+            return false;
+        }
+        done += span;
+    }
+    return true;
+}
+
+// Same again for calls that take a file range, like posix_fadvise. op returns 0 on success
+typedef int (*file_range_op_t)(int fd, off_t offset, off_t length, int arg);
+
+static bool block_range_op(const block_store_t *const bs, const size_t first, const size_t count,
+                           const file_range_op_t op, const int arg) {
+    for (size_t done = 0; done < count;) {
+        off_t offset;
+        size_t span;
+        const int fd = block_locate(bs, first + done, &offset, &span);
+        span         = span < count - done ? span : count - done;
+        if (op(fd, offset, (off_t) (bs->block_size * span), arg) != 0) {
+            return false;
+        }
+        done += span;
+    }
+    return true;
+}
+
+static int punch_op(const int fd, const off_t offset, const off_t length, const int mode) {
+    return fallocate(fd, mode, offset, length);
+}
+
+static int sync_range_op(const int fd, const off_t offset, const off_t length, const int flags) {
+    return sync_file_range(fd, offset, length, (unsigned) flags);
+}
+
+static inline uint8_t *cache_data(const block_store_t *const bs, const cache_slot_t *const slot) {
+    return bs->cache + (bs->block_size * (size_t)(slot - bs->slots));
+}
+
+static cache_slot_t *cache_find(block_store_t *const bs, const unsigned block_id) {
+    cache_slot_t *const set = bs->slots + (CACHE_WAYS * (block_id % bs->cache_sets));
+    for (unsigned way = 0; way < CACHE_WAYS; ++way) {
+        if (set[way].block_id == block_id) {
+            return set + way;
+        }
+    }
+    return NULL;
+}
+
+static bool cache_write_back(block_store_t *const bs, cache_slot_t *const slot) {
+    if (bitmap_test(bs->dirty, slot->block_id)) {
+        if (!block_io(bs, true, cache_data(bs, slot), slot->block_id, 1)) {
+            return false;
+        }
+        bitmap_reset(bs->dirty, slot->block_id);
+    }
+    return true;
+}
+
+// Finds the block's cache slot, bringing the block in if it isn't there
+// load can be false if the caller is about to overwrite the whole block anyway
+// NULL if the block is out of range, every slot in its set is pinned, or the I/O failed
+static cache_slot_t *cache_get(block_store_t *const bs, const unsigned block_id, const bool load) {
+    if (!BLOCK_IN_RANGE(bs, block_id)) {
+        return NULL;
+    }
+    cache_slot_t *slot = cache_find(bs, block_id);
+    if (!slot) {
+        // Evict the least recently used unpinned slot (empty slots are never used, so they go first)
+        cache_slot_t *const set = bs->slots + (CACHE_WAYS * (block_id % bs->cache_sets));
+        for (unsigned way = 0; way < CACHE_WAYS; ++way) {
+            if (!set[way].pins && (!slot || set[way].last_used < slot->last_used)) {
+                slot = set + way;
+            }
+        }
+        if (!slot || (slot->block_id && !cache_write_back(bs, slot))) {
+            return NULL;
+        }
+        slot->block_id  = 0;
+        slot->last_used = 0;
+        if (load && !block_io(bs, false, cache_data(bs, slot), block_id, 1)) {
+            return NULL;
+        }
+        slot->block_id = block_id;
+    }
+    slot->last_used = ++bs->cache_clock;
+    return slot;
+}
+
+// Called with the lock held, once a request is done one way or another
+static void async_complete(block_store_t *const bs, const unsigned slot, const bool success) {
+    async_engine_t *const engine   = &bs->async;
+    async_request_t *const request = engine->requests + slot;
+    request->success               = success;
+    if (request->internal) {
+        if (!success && request->tag < engine->internal_failed) {
+            engine->internal_failed = request->tag;
+        }
+        --engine->internal_pending;
+        engine->free_slots[engine->free_count++] = slot;
+    } else {
+        engine->done[(engine->done_head + engine->done_count++) % ASYNC_DEPTH] = slot;
+    }
+}
+
+static void *async_worker(void *arg) {
+    block_store_t *const bs      = (block_store_t *) arg;
+    async_engine_t *const engine = &bs->async;
+    pthread_mutex_lock(&engine->lock);
+    for (;;) {
+        while (!engine->work_count && !engine->stop) {
+            pthread_cond_wait(&engine->work_ready, &engine->lock);
+        }
+        if (!engine->work_count) {
+            break;
+        }
+        const unsigned slot = engine->work[engine->work_head];
+        engine->work_head   = (engine->work_head + 1) % ASYNC_DEPTH;
+        --engine->work_count;
+        const async_request_t *const request = engine->requests + slot;
+        pthread_mutex_unlock(&engine->lock);
+        const bool success = file_io(request->fd, false, request->dst, bs->block_size * request->count,
+                                     request->offset);
+        pthread_mutex_lock(&engine->lock);
+        --engine->in_flight;
+        async_complete(bs, slot, success);
+        pthread_cond_broadcast(&engine->work_done);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_teardown(uring_t *const ring) {
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+static bool uring_setup(uring_t *const ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, ASYNC_DEPTH, &params);
+    if (ring->fd < 0) {
+        // Old kernel, or a sandbox that won't allow it
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_teardown(ring);
+        return false;
+    }
+    uint8_t *const sq = (uint8_t *) ring->sq_ring;
+    uint8_t *const cq = (uint8_t *) ring->cq_ring;
+    ring->sq_tail     = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask     = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array    = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head     = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail     = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask     = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes        = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->to_submit   = 0;
+    return true;
+}
+
+// Puts a read in the SQ, the kernel doesn't see it until the next uring_enter
+// There are never more requests than SQ entries, so there's always room
+static void uring_queue(block_store_t *const bs, const unsigned slot) {
+    uring_t *const ring            = &bs->async.ring;
+    async_request_t *const request = bs->async.requests + slot;
+    const unsigned tail            = *ring->sq_tail;
+    const unsigned index           = tail & *ring->sq_mask;
+    struct io_uring_sqe *const sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode           = IORING_OP_READV;
+    sqe->fd               = request->fd;
+    sqe->addr             = (uint64_t) (uintptr_t) &request->iov;
+    sqe->len              = 1;
+    sqe->off              = (uint64_t) request->offset;
+    sqe->user_data        = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+}
+
+// Submits everything queued in one call, and optionally waits for a completion while it's there
+static void uring_enter(uring_t *const ring, const bool wait) {
+    const long res = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res > 0) {
+        ring->to_submit -= res;
+    }
+}
+
+// Called with the lock held
+static void uring_reap(block_store_t *const bs) {
+    uring_t *const ring = &bs->async.ring;
+    unsigned head       = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *const cqe = ring->cqes + (head & *ring->cq_mask);
+        const unsigned slot                  = (unsigned) cqe->user_data;
+        const async_request_t *const request = bs->async.requests + slot;
+        bool success                         = cqe->res == (int) request->iov.iov_len;
+        if (!success && cqe->res > 0) {
+            // Short read, finish it off the slow way
+            success = file_io(request->fd, false, request->dst + cqe->res, request->iov.iov_len - cqe->res,
+                              request->offset + cqe->res);
+        }
+        --bs->async.in_flight;
+        async_complete(bs, slot, success);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// Takes a free request slot for a read of count blocks starting at first, which all have to be in the same file
+// -1 if every slot is in use
+static int async_claim(block_store_t *const bs, const size_t first, const size_t count, void *const dst,
+                       const uint64_t tag, const bool internal) {
+    async_engine_t *const engine = &bs->async;
+    int slot                     = -1;
+    pthread_mutex_lock(&engine->lock);
+    if (engine->free_count) {
+        slot                           = engine->free_slots[--engine->free_count];
+        async_request_t *const request = engine->requests + slot;
+        request->dst                   = (uint8_t *) dst;
+        size_t span;
+        request->fd                    = block_locate(bs, first, &request->offset, &span);
+        request->first                 = first;
+        request->count                 = count;
+        request->tag                   = tag;
+        request->internal              = internal;
+        request->success               = false;
+        request->iov.iov_base          = dst;
+        request->iov.iov_len           = bs->block_size * count;
+        if (internal) {
+            ++engine->internal_pending;
+        } else {
+            ++engine->user_pending;
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return slot;
+}
+
+// Queues a claimed request for the next submission
+static void async_queue(block_store_t *const bs, const unsigned slot) {
+    async_engine_t *const engine = &bs->async;
+    pthread_mutex_lock(&engine->lock);
+    ++engine->in_flight;
+#ifdef HAVE_IO_URING
+    if (engine->uring) {
+        uring_queue(bs, slot);
+    } else
+#endif
+    {
+        engine->queued[engine->queued_count++] = slot;
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Hands everything queued to io_uring/the workers in one go
+static void async_submit(block_store_t *const bs) {
+    async_engine_t *const engine = &bs->async;
+#ifdef HAVE_IO_URING
+    if (engine->uring) {
+        if (engine->ring.to_submit) {
+            uring_enter(&engine->ring, false);
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&engine->lock);
+    if (engine->queued_count) {
+        for (size_t idx = 0; idx < engine->queued_count; ++idx) {
+            engine->work[(engine->work_head + engine->work_count++) % ASYNC_DEPTH] = engine->queued[idx];
+        }
+        engine->queued_count = 0;
+        pthread_cond_broadcast(&engine->work_ready);
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Picks up finished requests, waiting for at least one more if asked to and there's anything to wait on
+// Only call after async_submit, or the wait could be for a request nobody has started
+static void async_reap(block_store_t *const bs, const bool wait) {
+    async_engine_t *const engine = &bs->async;
+#ifdef HAVE_IO_URING
+    if (engine->uring) {
+        if (wait && engine->in_flight) {
+            uring_enter(&engine->ring, true);
+        }
+        pthread_mutex_lock(&engine->lock);
+        uring_reap(bs);
+        pthread_mutex_unlock(&engine->lock);
+        return;
+    }
+#endif
+    // The workers finish requests themselves, so there's only the waiting to do
+    pthread_mutex_lock(&engine->lock);
+    const size_t in_flight = engine->in_flight;
+    while (wait && in_flight && engine->in_flight == in_flight) {
+        pthread_cond_wait(&engine->work_done, &engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Waits out every readv request, returns the lowest failed tag (SIZE_MAX if they all worked)
+static size_t async_finish_internal(block_store_t *const bs) {
+    async_engine_t *const engine = &bs->async;
+    async_submit(bs);
+    pthread_mutex_lock(&engine->lock);
+    while (engine->internal_pending) {
+        pthread_mutex_unlock(&engine->lock);
+        async_reap(bs, true);
+        pthread_mutex_lock(&engine->lock);
+    }
+    const size_t failed     = engine->internal_failed;
+    engine->internal_failed = SIZE_MAX;
+    pthread_mutex_unlock(&engine->lock);
+    return failed;
+}
+
+// Every backend takes async reads, but only BS_BACKEND_ASYNC actually runs them in the background
+// io_uring if the kernel will give us one, a few pread threads if not
+static bool async_start(block_store_t *const bs) {
+    async_engine_t *const engine = &bs->async;
+    for (unsigned slot = 0; slot < ASYNC_DEPTH; ++slot) {
+        engine->free_slots[slot] = ASYNC_DEPTH - 1 - slot;
+    }
+    engine->free_count      = ASYNC_DEPTH;
+    engine->internal_failed = SIZE_MAX;
+    if (pthread_mutex_init(&engine->lock, NULL) == 0) {
+        if (pthread_cond_init(&engine->work_ready, NULL) == 0) {
+            if (pthread_cond_init(&engine->work_done, NULL) == 0) {
+                if (bs->backend != BS_BACKEND_ASYNC) {
+                    return true;
+                }
+#ifdef HAVE_IO_URING
+                if ((engine->uring = uring_setup(&engine->ring))) {
+                    return true;
+                }
+#endif
+                while (engine->worker_count < ASYNC_WORKERS
+                       && pthread_create(engine->workers + engine->worker_count, NULL, async_worker, bs) == 0) {
+                    ++engine->worker_count;
+                }
+                if (engine->worker_count) {
+                    return true;
+                }
+                pthread_cond_destroy(&engine->work_done);
+            }
+            pthread_cond_destroy(&engine->work_ready);
+        }
+        pthread_mutex_destroy(&engine->lock);
+    }
+    return false;
+}
+
+static void async_stop(block_store_t *const bs) {
+    async_engine_t *const engine = &bs->async;
+    // Reads land in the caller's buffers, so nothing can be left running once we're gone
+    async_submit(bs);
+    pthread_mutex_lock(&engine->lock);
+    while (engine->in_flight) {
+        pthread_mutex_unlock(&engine->lock);
+        async_reap(bs, true);
+        pthread_mutex_lock(&engine->lock);
+    }
+#ifdef HAVE_IO_URING
+    if (engine->uring) {
+        uring_teardown(&engine->ring);
+    }
+#endif
+    engine->stop = true;
+    pthread_cond_broadcast(&engine->work_ready);
+    pthread_mutex_unlock(&engine->lock);
+    for (unsigned worker = 0; worker < engine->worker_count; ++worker) {
+        pthread_join(engine->workers[worker], NULL);
+    }
+    pthread_cond_destroy(&engine->work_done);
+    pthread_cond_destroy(&engine->work_ready);
+    pthread_mutex_destroy(&engine->lock);
+}
+
+static size_t fault_count(void) {
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? (size_t) (usage.ru_minflt + usage.ru_majflt) : 0;
+}
+
+// Faults in every page of the mapping
+static void populate_image(block_store_t *const bs) {
+#ifdef MADV_POPULATE_READ
+    if (madvise(bs->data_blocks, IMAGE_BYTES(bs), MADV_POPULATE_READ) == 0) {
+        return;
+    }
+#endif
+    // Kernel's too old for that, so touch a byte of every page
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < IMAGE_BYTES(bs); offset += page_size) {
+        (void) *(volatile uint8_t *) (bs->data_blocks + offset);
+    }
+}
+
+// mmap backend: the whole image is one shared mapping, FBM included
+// prefault takes every page fault now instead of at first touch (counted, for block_store_get_prefaulted)
+// huge_pages asks for transparent huge pages on the data area, which has to happen before it's faulted in
+static bool map_image(block_store_t *const bs, const bool init, const bool prefault, const bool huge_pages) {
+    const size_t faults_before = fault_count();
+    const int populate         = prefault && !huge_pages ? MAP_POPULATE : 0;
+    bs->data_blocks = (uint8_t *) mmap(NULL, IMAGE_BYTES(bs), PROT_READ | PROT_WRITE, MAP_SHARED | populate, bs->fd, 0);
+    if (bs->data_blocks != (uint8_t *) MAP_FAILED) {
+        // Woo hoo! Done. Mostly. Kinda.
+        if (init) {
+            // New images are truncated (or memfd) and so read as zeroes already, and stay sparse
+            // as long as nothing writes to them. So the FBM's own bits are the only thing to set
+            reserve_fbm(bs);
+        }
+        // Split the advice by region: the FBM is small and hit on every allocation, so pull it in now
+        // Data access is whatever the user is doing, so no readahead unless they tell us (block_store_advise)
+        // Advice is just advice, so failures here don't matter
+        // madvise wants page boundaries, so the data area's advice starts at the first page past the FBM
+        const size_t page_mask  = (size_t) sysconf(_SC_PAGESIZE) - 1;
+        const size_t data_start = (FBM_BYTES(bs) + page_mask) & ~page_mask;
+        madvise(bs->data_blocks, FBM_BYTES(bs), MADV_WILLNEED);
+        if (data_start < IMAGE_BYTES(bs)) {
+            madvise(bs->data_blocks + data_start, IMAGE_BYTES(bs) - data_start, huge_pages ? MADV_HUGEPAGE : MADV_RANDOM);
+        }
+        if (prefault) {
+            if (huge_pages) {
+                populate_image(bs);
+            }
+            bs->prefaulted = fault_count() - faults_before;
+        }
+        return true;
+    }
+    return false;
+}
+
+// pread backend: the FBM is read into its own buffer and data blocks go through the cache
+// Buffers are aligned so they can be handed to an O_DIRECT file as-is
+// prefault just gets the kernel reading the whole file into the page cache
+static bool cache_setup(block_store_t *const bs, const bool init, const size_t cache_blocks, const bool prefault) {
+    void *fbm_buffer, *cache_buffer;
+    const size_t blocks = cache_blocks ? cache_blocks : CACHE_DEFAULT_BYTES / bs->block_size;
+    bs->cache_sets      = (blocks + CACHE_WAYS - 1) / CACHE_WAYS;
+    bs->slots      = (cache_slot_t *) calloc(bs->cache_sets * CACHE_WAYS, sizeof(cache_slot_t));
+    if (bs->slots && posix_memalign(&fbm_buffer, IO_ALIGNMENT, FBM_BYTES(bs)) == 0) {
+        bs->data_blocks = (uint8_t *) fbm_buffer;
+        if (posix_memalign(&cache_buffer, IO_ALIGNMENT, bs->cache_sets * CACHE_WAYS * bs->block_size) == 0) {
+            bs->cache = (uint8_t *) cache_buffer;
+            bool loaded;
+            if (init) {
+                // The file was just truncated, so it's zeroes already and only the FBM needs setting up
+                memset(bs->data_blocks, 0x00, FBM_BYTES(bs));
+                reserve_fbm(bs);
+                loaded = true;
+            } else {
+                loaded = block_io(bs, false, bs->data_blocks, 0, bs->fbm_blocks);
             }
-            close(fd);
+            if (loaded) {
+                for (size_t idx = 0; idx < bs->stripe_count; ++idx) {
+                    posix_fadvise(bs->stripe_fds[idx], 0, 0, prefault ? POSIX_FADV_WILLNEED : POSIX_FADV_RANDOM);
+                }
+                return true;
+            }
+            free(bs->cache);
         }
+        free(bs->data_blocks);
     }
-    return -1;
+    free(bs->slots);
+    return false;
 }
-int check_file(const char *const fname) {
-    if (fname) {
-        int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (fd != -1) {
-            struct stat file_info;
-            if (fstat(fd, &file_info) != -1 && file_info.st_size == BYTE_TOTAL) {
-                return fd;
-            }
-            close(fd);
+
+static void release_image(block_store_t *const bs) {
+    if (bs->backend != BS_BACKEND_MMAP) {
+        free(bs->cache);
+        free(bs->data_blocks);
+        free(bs->slots);
+    } else {
+        munmap(bs->data_blocks, IMAGE_BYTES(bs));
+    }
+}
+
+// Takes the block off the released list, true if it can be punched out
+// It can't if it got allocated again since, or it's pinned in the cache
+// Otherwise its cached copy goes, since writing that back would just fill the hole in again
+static bool discard_ready(block_store_t *const bs, const size_t block) {
+    if (!bitmap_test(bs->released, block)) {
+        return false;
+    }
+    bitmap_reset(bs->released, block);
+    --bs->released_count;
+    if (bitmap_test(bs->fbm, block)) {
+        return false;
+    }
+    cache_slot_t *const slot = bs->slots ? cache_find(bs, block) : NULL;
+    if (slot && slot->pins) {
+        return false;
+    }
+    // Punching changes it as much as a write would
+    cow_preserve(bs, block);
+    if (slot) {
+        slot->block_id  = 0;
+        slot->last_used = 0;
+    }
+    bitmap_reset(bs->dirty, block);
+    return true;
+}
+
+static bool punch_blocks(block_store_t *const bs, const size_t first, const size_t end) {
+    if (bs->packed_map) {
+        // Compressed: there's no hole to punch, the records are just forgotten and compaction takes the space back
+        for (size_t block = first; block < end; ++block) {
+            packed_drop(bs, block);
         }
+        return true;
     }
-    return -1;
+    if (block_range_op(bs, first, end - first, punch_op, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        return true;
+    }
+    if (errno == EOPNOTSUPP) {
+        // The filesystem can't do it, so there's no point keeping track any more
+        bitmap_destroy(bs->released);
+        bs->released       = NULL;
+        bs->released_count = 0;
+        return true;
+    }
+    return false;
 }
 
+// Punches out the released blocks in the range, one fallocate per run of them
+static bool discard_released(block_store_t *const bs, const size_t first, const size_t count) {
+    const size_t last = first + count;
+    size_t run_first  = 0;
+    size_t run_end    = 0;
+    bool success      = true;
+    for (size_t block = first; bs->released && bs->released_count; ++block) {
+        block = bitmap_next_set(bs->released, block);
+        if (block >= last) {
+            break;
+        }
+        if (discard_ready(bs, block)) {
+            if (block != run_end) {
+                success   = punch_blocks(bs, run_first, run_end) && success;
+                run_first = block;
+            }
+            run_end = block + 1;
+        }
+    }
+    if (bs->released && first <= bs->fbm_blocks && last >= bs->block_count) {
+        // Everything's been looked at, whatever the count still says was overcounting
+        bs->released_count = 0;
+    }
+    return (!bs->released || punch_blocks(bs, run_first, run_end)) && success;
+}
 
-block_store_t *block_store_init(const bool init, const char *const fname) {
-    if (fname) {
-        block_store_t *bs = (block_store_t *) malloc(sizeof(block_store_t));
+// More than one file makes a striped store, with stripe units of stripe_blocks (0 for the default) when creating
+block_store_t *block_store_init(const store_origin_t origin, const char *const *const fnames, const size_t file_count,
+                                const size_t stripe_blocks, const block_store_config_t *const config) {
+    static const block_store_config_t defaults = {BS_BACKEND_MMAP, 0, false, 0, 0, false, false, false, false};
+    // Striped stores can't be mapped as one image, and the point is reading the files in parallel anyway
+    static const block_store_config_t striped_defaults = {BS_BACKEND_ASYNC, 0, false, 0, 0, false, false, false, false};
+    const bool striped                     = file_count > 1;
+    const block_store_config_t *const conf = config ? config : striped ? &striped_defaults : &defaults;
+    const bool init                        = origin != STORE_OPEN;
+    const bool anon                        = origin == STORE_CREATE_ANON;
+    geometry_record_t geometry = {GEOMETRY_MAGIC, GEOMETRY_VERSION,
+                                  (uint32_t) (conf->block_size ? conf->block_size : BLOCK_STORE_DEFAULT_BLOCK_SIZE),
+                                  conf->block_count ? conf->block_count : BLOCK_STORE_DEFAULT_BLOCK_COUNT};
+    const size_t unit = stripe_blocks ? stripe_blocks
+                                      : (STRIPE_DEFAULT_BYTES > geometry.block_size ? STRIPE_DEFAULT_BYTES / geometry.block_size : 1);
+    // O_DIRECT and a shared mapping of the same file don't mix, and memory has no use for O_DIRECT at all
+    if ((anon || (fnames && file_count && fnames[0])) && conf->backend <= BS_BACKEND_ASYNC
+        && (!conf->direct || (conf->backend != BS_BACKEND_MMAP && !anon))
+        && (!striped || (conf->backend != BS_BACKEND_MMAP && file_count <= UINT32_MAX && unit <= geometry.block_count))
+        && (!init || !conf->compress || (conf->backend != BS_BACKEND_MMAP && !conf->direct && !striped))
+        && (!init || (conf->block_size <= BLOCK_SIZE_MAX && geometry_valid(geometry.block_size, geometry.block_count)))) {
+        block_store_t *bs = (block_store_t *) calloc(1, sizeof(block_store_t));
         if (bs) {
-            bs->fd = init ? create_file(fname) : check_file(fname);
+            bs->backend   = conf->backend;
+            bs->direct    = conf->direct;
+            const int flags = bs->direct ? O_DIRECT : 0;
+            if (striped) {
+                if (!open_stripes(bs, init, fnames, file_count, unit, flags, &geometry)) {
+                    bs->fd = -1;
+                }
+            } else {
+                bs->fd = init && conf->compress ? create_packed(anon ? NULL : fnames[0], &geometry)
+                         : anon                 ? create_anon(&geometry)
+                         : init ? create_file(fnames[0], flags, &geometry) : check_file(fnames[0], flags, &geometry);
+                bs->stripe_fds    = &bs->fd;
+                bs->stripe_count  = 1;
+                bs->stripe_blocks = geometry.block_count;
+            }
             if (bs->fd != -1) {
-                bs->data_blocks = (uint8_t *) mmap(NULL, BYTE_TOTAL, PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, 0);
-                if (bs->data_blocks != (uint8_t *) MAP_FAILED) {
-                    // Woo hoo! Done. Mostly. Kinda.
-                    if (init) {
-                        // init FBM and wipe remaining data
-                        // Could/should be done in create_file
-                        // but it's so much easier here...
-                        memset(bs->data_blocks, 0xFF, FBM_BLOCK_COUNT >> 3);
-                        memset(bs->data_blocks + FBM_BYTE_TOTAL, 0x00, DATA_BLOCK_BYTE_TOTAL);
+                bs->block_size  = geometry.block_size;
+                bs->block_count = geometry.block_count;
+                bs->fbm_blocks  = BLOCK_STORE_FBM_BLOCKS(bs->block_size, bs->block_count);
+                const bool packed = init ? conf->compress : geometry.magic == PACKED_MAGIC;
+                if (packed) {
+                    // The log can't be mapped, and async reads want blocks at fixed offsets
+                    bs->backend = BS_BACKEND_PREAD;
+                }
+                if ((!packed || packed_setup(bs, init))
+                    && (bs->backend != BS_BACKEND_MMAP ? cache_setup(bs, init, conf->cache_blocks, conf->prefault)
+                                                       : map_image(bs, init, conf->prefault, conf->huge_pages))) {
+                    bs->fbm   = bitmap_overlay(bs->block_count, bs->data_blocks);
+                    bs->dirty = bitmap_create(bs->block_count);
+                    if (conf->discard) {
+                        bs->released = bitmap_create(bs->block_count);
                     }
-                    // Not quite sure what to do with madvise
-                    // Honestly, I feel like a split mapping may be best
-                    // Sequential for the FBM, random for the data
-                    // but I'll just not mess with it unless I get the time to profile them
-                    // madvise()
-                    bs->fbm = bitmap_overlay(BLOCK_COUNT, bs->data_blocks);
-                    if (bs->fbm) {
+                    if (bs->fbm && bs->dirty && (bs->released || !conf->discard) && async_start(bs)) {
+                        bs->alloc_cursor = bs->fbm_blocks;
+                        bs->used_blocks  = bitmap_total_set(bs->fbm);
+                        if (init) {
+                            for (size_t block = 0; block <= FBM_BLOCK_OF(bs, bs->fbm_blocks - 1); ++block) {
+                                bitmap_set(bs->dirty, block);
+                            }
+                        }
                         return bs;
                     }
-                    munmap(bs->data_blocks, BYTE_TOTAL);
+                    bitmap_destroy(bs->fbm);
+                    bitmap_destroy(bs->dirty);
+                    bitmap_destroy(bs->released);
+                    release_image(bs);
                 }
-                close(bs->fd);
+                packed_release(bs);
+                close_files(bs);
             }
             free(bs);
         }
@@ -87,52 +1481,251 @@ block_store_t *block_store_init(const bool init, const char *const fname) {
 }
 
 block_store_t *block_store_create(const char *const fname) {
-    return block_store_init(true, fname);
+    return block_store_init(STORE_CREATE, &fname, 1, 0, NULL);
 }
 
 block_store_t *block_store_open(const char *const fname) {
-    return block_store_init(false, fname);
+    return block_store_init(STORE_OPEN, &fname, 1, 0, NULL);
+}
+
+block_store_t *block_store_create_config(const char *const fname, const block_store_config_t *const config) {
+    return block_store_init(STORE_CREATE, &fname, 1, 0, config);
+}
+
+block_store_t *block_store_open_config(const char *const fname, const block_store_config_t *const config) {
+    return block_store_init(STORE_OPEN, &fname, 1, 0, config);
+}
+
+block_store_t *block_store_create_anon(void) {
+    return block_store_init(STORE_CREATE_ANON, NULL, 0, 0, NULL);
+}
+
+block_store_t *block_store_create_anon_config(const block_store_config_t *const config) {
+    return block_store_init(STORE_CREATE_ANON, NULL, 0, 0, config);
+}
+
+block_store_t *block_store_create_striped(const char *const *const fnames, const size_t count,
+                                          const size_t stripe_blocks, const block_store_config_t *const config) {
+    for (size_t idx = 0; fnames && idx < count; ++idx) {
+        if (!fnames[idx]) {
+            return NULL;
+        }
+    }
+    return block_store_init(STORE_CREATE, fnames, count, stripe_blocks, config);
+}
+
+block_store_t *block_store_open_striped(const char *const *const fnames, const size_t count,
+                                        const block_store_config_t *const config) {
+    for (size_t idx = 0; fnames && idx < count; ++idx) {
+        if (!fnames[idx]) {
+            return NULL;
+        }
+    }
+    return block_store_init(STORE_OPEN, fnames, count, 0, config);
+}
+
+size_t block_store_get_block_size(const block_store_t *const bs) {
+    return bs ? bs->block_size : 0;
+}
+
+size_t block_store_get_block_count(const block_store_t *const bs) {
+    return bs ? bs->block_count : 0;
+}
+
+size_t block_store_get_prefaulted(const block_store_t *const bs) {
+    return bs ? bs->prefaulted : 0;
+}
+
+size_t block_store_get_stored_bytes(const block_store_t *const bs) {
+    return bs ? (bs->packed_map ? bs->log_end : IMAGE_BYTES(bs)) : 0;
+}
+
+size_t block_store_free_count(const block_store_t *const bs) {
+    return bs ? bs->block_count - bs->used_blocks : 0;
+}
+
+size_t block_store_used_count(const block_store_t *const bs) {
+    return bs ? bs->used_blocks : 0;
+}
+
+size_t block_store_largest_free_extent(const block_store_t *const bs) {
+    size_t largest = 0;
+    if (bs) {
+        // Hop from each free run's start to its end and on to the next, a word at a time
+        size_t block = bitmap_next_zero(bs->fbm, bs->fbm_blocks);
+        while (block != SIZE_MAX && bs->block_count - block > largest) {
+            const size_t used = bitmap_next_set(bs->fbm, block);
+            const size_t end  = used != SIZE_MAX ? used : bs->block_count;
+            largest           = end - block > largest ? end - block : largest;
+            block             = bitmap_next_zero(bs->fbm, end);
+        }
+    }
+    return largest;
 }
 
 void block_store_close(block_store_t *const bs) {
     if (bs) {
+        // Snapshots still open have nothing left to read from
+        for (block_store_snapshot_t *snap = bs->snapshots; snap; snap = snap->next) {
+            snap->origin = NULL;
+        }
+        bs->snapshots = NULL;
+        async_stop(bs);
+        if (bs->backend != BS_BACKEND_MMAP) {
+            // Cached changes only exist in here, they have to reach the file before it all goes
+            // Compressed stores need a synchronous flush, that's the only kind that commits their map
+            block_store_flush(bs, !bs->packed_map);
+        } else {
+            discard_released(bs, bs->fbm_blocks, bs->block_count - bs->fbm_blocks);
+        }
         bitmap_destroy(bs->fbm);
-        munmap(bs->data_blocks, BYTE_TOTAL);
-        close(bs->fd);
+        bitmap_destroy(bs->dirty);
+        bitmap_destroy(bs->released);
+        release_image(bs);
+        packed_release(bs);
+        close_files(bs);
         free(bs);
     }
 }
 
 unsigned block_store_allocate(block_store_t *const bs) {
+    return bs ? block_store_allocate_near(bs, bs->alloc_cursor) : 0;
+}
+
+unsigned block_store_allocate_near(block_store_t *const bs, const unsigned hint) {
     if (bs) {
-        size_t free_block = bitmap_ffz(bs->fbm);
+        size_t free_block = bitmap_next_zero(bs->fbm, hint);
+        if (free_block == SIZE_MAX) {
+            // Nothing past the hint, wrap around
+            free_block = bitmap_ffz(bs->fbm);
+        }
         if (free_block != SIZE_MAX) {
-            bitmap_set(bs->fbm, free_block);
+            fbm_claim(bs, free_block);
+            bs->alloc_cursor = free_block + 1;
             return free_block;
         }
     }
     return 0;
 }
 
+size_t block_store_allocate_extent(block_store_t *const bs, const size_t count, unsigned *const out_ids) {
+    size_t total = 0;
+    if (bs && out_ids) {
+        // Contiguous if there's room for it anywhere
+        const size_t run = bitmap_ffz_run(bs->fbm, count, bs->alloc_cursor);
+        if (run != SIZE_MAX) {
+            fbm_claim_range(bs, run, count);
+            for (; total < count; ++total) {
+                out_ids[total] = run + total;
+            }
+            bs->alloc_cursor = run + count;
+        }
+        // Otherwise piece it together from whatever runs there are
+        while (total < count) {
+            // Start of a run
+            const size_t block = block_store_allocate(bs);
+            if (!block) {
+                break;
+            }
+            out_ids[total++] = block;
+            // And take its neighbours for as long as they're free, all in one go
+            size_t end = bitmap_next_set(bs->fbm, block + 1);
+            end        = end == SIZE_MAX ? bs->block_count : end;
+            end        = end - block - 1 > count - total ? block + 1 + count - total : end;
+            if (end > block + 1) {
+                fbm_claim_range(bs, block + 1, end - block - 1);
+                for (size_t next = block + 1; next < end; ++next) {
+                    out_ids[total++] = next;
+                }
+            }
+            bs->alloc_cursor = end;
+        }
+    }
+    return total;
+}
+
 bool block_store_request(block_store_t *const bs, const unsigned block_id) {
-    if (bs && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT) {
+    if (bs && BLOCK_IN_RANGE(bs, block_id)) {
         if (!bitmap_test(bs->fbm, block_id)) {
-            bitmap_set(bs->fbm, block_id);
+            fbm_claim(bs, block_id);
             return true;
         }
     }
     return false;
 }
 
+bool block_store_request_range(block_store_t *const bs, const unsigned first, const unsigned count) {
+    if (bs && count && BLOCK_IN_RANGE(bs, first) && count <= bs->block_count - first
+        && !bitmap_range_count(bs->fbm, first, count)) {
+        fbm_claim_range(bs, first, count);
+        return true;
+    }
+    return false;
+}
+
 void block_store_release(block_store_t *const bs, const unsigned block_id) {
-    if (bs && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT) {
-        bitmap_reset(bs->fbm, block_id);
+    if (bs && BLOCK_ACCESSIBLE(bs, block_id)) {
+        fbm_free(bs, block_id);
+        if (bs->released && !bitmap_test(bs->released, block_id)) {
+            bitmap_set(bs->released, block_id);
+            if (++bs->released_count >= DISCARD_BATCH) {
+                discard_released(bs, bs->fbm_blocks, bs->block_count - bs->fbm_blocks);
+            }
+        }
+    }
+}
+
+// Range release for release_many/release_range, the range has already been checked
+static void release_blocks(block_store_t *const bs, const size_t first, const size_t count) {
+    fbm_free_range(bs, first, count);
+    if (bs->released) {
+        bitmap_set_range(bs->released, first, count);
+        bs->released_count += count;
+        if (bs->released_count >= DISCARD_BATCH) {
+            discard_released(bs, bs->fbm_blocks, bs->block_count - bs->fbm_blocks);
+        }
+    }
+}
+
+size_t block_store_release_many(block_store_t *const bs, const unsigned *const block_ids, const size_t count) {
+    size_t total = 0;
+    if (bs && block_ids) {
+        for (size_t idx = 0; idx < count;) {
+            const unsigned first = block_ids[idx++];
+            if (!BLOCK_IN_RANGE(bs, first)) {
+                continue;
+            }
+            size_t run = 1;
+            for (; idx < count && block_ids[idx] == first + run && first + run < bs->block_count; ++idx) {
+                ++run;
+            }
+            release_blocks(bs, first, run);
+            total += run;
+        }
+    }
+    return total;
+}
+
+bool block_store_release_range(block_store_t *const bs, const unsigned first, const unsigned count) {
+    if (bs && count && BLOCK_IN_RANGE(bs, first) && count <= bs->block_count - first) {
+        release_blocks(bs, first, count);
+        return true;
     }
+    return false;
 }
 
 bool block_store_read(block_store_t *const bs, const unsigned block_id, void *const dst) {
-    if (bs && dst && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT /* && bitmap_set(bs->fbm,block_id) */) {
-        memcpy(dst, bs->data_blocks + (BLOCK_SIZE * block_id), BLOCK_SIZE);
+    if (bs && dst && BLOCK_ACCESSIBLE(bs, block_id)) {
+        if (bs->backend != BS_BACKEND_MMAP) {
+            // Single blocks are usually metadata that gets hit again, so they go through the cache
+            const cache_slot_t *const slot = cache_get(bs, block_id, true);
+            if (!slot) {
+                return false;
+            }
+            memcpy(dst, cache_data(bs, slot), bs->block_size);
+            return true;
+        }
+        memcpy(dst, bs->data_blocks + (bs->block_size * block_id), bs->block_size);
         return true;
     }
     return false;
@@ -140,9 +1733,504 @@ bool block_store_read(block_store_t *const bs, const unsigned block_id, void *co
 
 
 bool block_store_write(block_store_t *const bs, const unsigned block_id, const void *const src) {
-    if (bs && src && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT /* && bitmap_set(bs->fbm,block_id) */) {
-        memcpy(bs->data_blocks + (BLOCK_SIZE * block_id), src, BLOCK_SIZE);
+    if (bs && src && BLOCK_ACCESSIBLE(bs, block_id)) {
+        cow_preserve(bs, block_id);
+        if (bs->backend != BS_BACKEND_MMAP) {
+            const cache_slot_t *const slot = cache_get(bs, block_id, false);
+            if (!slot) {
+                return false;
+            }
+            memcpy(cache_data(bs, slot), src, bs->block_size);
+            bitmap_set(bs->dirty, block_id);
+            return true;
+        }
+        memcpy(bs->data_blocks + (bs->block_size * block_id), src, bs->block_size);
+        bitmap_set(bs->dirty, block_id);
+        return true;
+    }
+    return false;
+}
+
+// Vectored I/O for the pread backend
+// Cached blocks (and everything, under O_DIRECT) are copied through the cache
+// runs of adjacent uncached blocks go straight between the caller's buffer and the file, one call per run
+static size_t cache_transfer(block_store_t *const bs, const bool write, const unsigned *const block_ids,
+                             const size_t count, uint8_t *const buffer) {
+    size_t done    = 0;
+    bool in_flight = false;
+    while (done < count && BLOCK_ACCESSIBLE(bs, block_ids[done])) {
+        const size_t first = block_ids[done];
+        uint8_t *const data = buffer + (bs->block_size * done);
+        if (bs->direct || cache_find(bs, first)) {
+            if (write) {
+                cow_preserve(bs, first);
+            }
+            const cache_slot_t *const slot = cache_get(bs, first, !write);
+            if (!slot) {
+                break;
+            }
+            if (write) {
+                memcpy(cache_data(bs, slot), data, bs->block_size);
+                bitmap_set(bs->dirty, first);
+            } else {
+                memcpy(data, cache_data(bs, slot), bs->block_size);
+            }
+            ++done;
+            continue;
+        }
+        // Runs stop at the end of the file they're in, striped stores carry on in the next
+        off_t offset;
+        size_t span;
+        block_locate(bs, first, &offset, &span);
+        size_t run = 1;
+        while (done + run < count && run < span && block_ids[done + run] == first + run && !cache_find(bs, first + run)) {
+            ++run;
+        }
+        if (!write && bs->backend == BS_BACKEND_ASYNC) {
+            // Every run goes out at once, they're all submitted together and waited on at the end
+            const int slot = async_claim(bs, first, run, data, done, true);
+            if (slot != -1) {
+                async_queue(bs, slot);
+                in_flight = true;
+                done += run;
+                continue;
+            }
+        }
+        for (size_t block = first; write && block < first + run; ++block) {
+            cow_preserve(bs, block);
+        }
+        if (!block_io(bs, write, data, first, run)) {
+            break;
+        }
+        done += run;
+    }
+    if (in_flight) {
+        const size_t failed = async_finish_internal(bs);
+        if (failed < done) {
+            done = failed;
+        }
+    }
+    return done;
+}
+
+size_t block_store_readv(block_store_t *const bs, const unsigned *const block_ids, const size_t count, void *const dst) {
+    size_t done = 0;
+    if (bs && block_ids && dst && bs->backend != BS_BACKEND_MMAP) {
+        done = cache_transfer(bs, false, block_ids, count, (uint8_t *) dst);
+    } else if (bs && block_ids && dst) {
+        while (done < count && BLOCK_ACCESSIBLE(bs, block_ids[done])) {
+            // Adjacent ids are adjacent in the mapping, so each run is one copy
+            const size_t first = block_ids[done];
+            size_t run         = 1;
+            while (done + run < count && block_ids[done + run] == first + run && first + run < bs->block_count) {
+                ++run;
+            }
+            memcpy((uint8_t *) dst + (bs->block_size * done), bs->data_blocks + (bs->block_size * first), bs->block_size * run);
+            done += run;
+        }
+    }
+    return done;
+}
+
+size_t block_store_writev(block_store_t *const bs, const unsigned *const block_ids, const size_t count,
+                          const void *const src) {
+    size_t done = 0;
+    if (bs && block_ids && src && bs->backend != BS_BACKEND_MMAP) {
+        done = cache_transfer(bs, true, block_ids, count, (uint8_t *) src);
+    } else if (bs && block_ids && src) {
+        while (done < count && BLOCK_ACCESSIBLE(bs, block_ids[done])) {
+            const size_t first = block_ids[done];
+            size_t run         = 1;
+            while (done + run < count && block_ids[done + run] == first + run && first + run < bs->block_count) {
+                ++run;
+            }
+            for (size_t block = first; block < first + run; ++block) {
+                cow_preserve(bs, block);
+                bitmap_set(bs->dirty, block);
+            }
+            memcpy(bs->data_blocks + (bs->block_size * first), (const uint8_t *) src + (bs->block_size * done), bs->block_size * run);
+            done += run;
+        }
+    }
+    return done;
+}
+
+// Writable mappings can be written through any time until they're unmapped, so snapshots get their copy now
+static void *map_block(block_store_t *const bs, const unsigned block_id, const bool writable) {
+    if (bs && BLOCK_ACCESSIBLE(bs, block_id)) {
+        if (writable) {
+            cow_preserve(bs, block_id);
+        }
+        if (bs->backend != BS_BACKEND_MMAP) {
+            // Pinned in the cache until it's unmapped
+            cache_slot_t *const slot = cache_get(bs, block_id, true);
+            if (slot) {
+                ++slot->pins;
+                return cache_data(bs, slot);
+            }
+            return NULL;
+        }
+        return bs->data_blocks + (bs->block_size * (size_t) block_id);
+    }
+    return NULL;
+}
+
+const void *block_store_map_block(block_store_t *const bs, const unsigned block_id) {
+    return map_block(bs, block_id, false);
+}
+
+void *block_store_map_block_writable(block_store_t *const bs, const unsigned block_id) {
+    return map_block(bs, block_id, true);
+}
+
+void block_store_unmap_block(block_store_t *const bs, const unsigned block_id, const bool dirty) {
+    // mmap: everything lives in the shared mapping already, nothing to write back or unpin
+    // Just remember it needs flushing
+    if (bs && BLOCK_IN_RANGE(bs, block_id)) {
+        if (bs->backend != BS_BACKEND_MMAP) {
+            cache_slot_t *const slot = cache_find(bs, block_id);
+            if (!slot || !slot->pins) {
+                return;
+            }
+            --slot->pins;
+        }
+        if (dirty) {
+            bitmap_set(bs->dirty, block_id);
+        }
+    }
+}
+
+bool block_store_advise(block_store_t *const bs, const unsigned first, const unsigned count,
+                        const block_store_advice_t advice) {
+    static const int advice_flags[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+    static const int fadvice_flags[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+                                        POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+    if (bs && count && first < bs->block_count && count <= bs->block_count - first && advice <= BS_ADVICE_DONTNEED) {
+        if (bs->packed_map) {
+            // Compressed blocks are wherever they landed in the log, there's no range of the file to advise on
+            return true;
+        }
+        if (bs->backend != BS_BACKEND_MMAP) {
+            return block_range_op(bs, first, count, posix_fadvise, fadvice_flags[advice]);
+        }
+        // madvise wants page boundaries, and blocks are smaller than pages
+        // so widen to the pages that hold the range
+        const size_t page_mask = (size_t) sysconf(_SC_PAGESIZE) - 1;
+        const size_t start     = ((size_t) first * bs->block_size) & ~page_mask;
+        const size_t end       = (((size_t) first + count) * bs->block_size + page_mask) & ~page_mask;
+        return madvise(bs->data_blocks + start, end - start, advice_flags[advice]) == 0;
+    }
+    return false;
+}
+
+// Waits for everything written to the files so far to reach the disk
+static bool sync_files(block_store_t *const bs) {
+    bool success = true;
+    for (size_t idx = 0; idx < bs->stripe_count; ++idx) {
+        success = fdatasync(bs->stripe_fds[idx]) == 0 && success;
+    }
+    return success;
+}
+
+// pread backend flush: dirty FBM blocks come from the FBM buffer, dirty data blocks from their cache slots
+// then the file gets synced, since pwrite only got them as far as the page cache
+static bool cache_flush_range(block_store_t *const bs, const size_t first, const size_t count, const bool async) {
+    const size_t last = first + count;
+    bool success      = true;
+    for (size_t block = bitmap_next_set(bs->dirty, first); block < last; block = bitmap_next_set(bs->dirty, block + 1)) {
+        if (block < bs->fbm_blocks) {
+            size_t run = 1;
+            while (block + run < last && block + run < bs->fbm_blocks && bitmap_test(bs->dirty, block + run)) {
+                ++run;
+            }
+            if (block_io(bs, true, bs->data_blocks + (bs->block_size * block), block, run)) {
+                for (size_t idx = block; idx < block + run; ++idx) {
+                    bitmap_reset(bs->dirty, idx);
+                }
+            } else {
+                success = false;
+            }
+            block += run - 1;
+        } else {
+            cache_slot_t *const slot = cache_find(bs, block);
+            success = slot && cache_write_back(bs, slot) && success;
+        }
+    }
+    if (bs->packed_map) {
+        // Committing the map takes syncs of its own, so async flushes leave it for the next sync, flush or close
+        success = (async ? sync_file_range(bs->fd, 0, 0, SYNC_FILE_RANGE_WRITE) == 0 : packed_commit(bs)) && success;
+    } else if (async) {
+        block_range_op(bs, first, count, sync_range_op, SYNC_FILE_RANGE_WRITE);
+    } else {
+        success = sync_files(bs) && success;
+    }
+    return success;
+}
+
+// mmap backend flush
+// msync works on pages, so dirty blocks are gathered into runs of pages
+// with runs that share or touch a page merged, so each stretch of dirty pages is one call
+static bool map_flush_range(block_store_t *const bs, const size_t first, const size_t count, const bool async) {
+    const size_t page_mask = (size_t) sysconf(_SC_PAGESIZE) - 1;
+    const size_t last      = first + count;
+    size_t block           = bitmap_next_set(bs->dirty, first);
+    bool success           = true;
+    while (block < last) {
+        const size_t run_first  = block;
+        const size_t sync_start = (block * bs->block_size) & ~page_mask;
+        size_t sync_end         = ((block + 1) * bs->block_size + page_mask) & ~page_mask;
+        for (block = bitmap_next_set(bs->dirty, block + 1); block < last; block = bitmap_next_set(bs->dirty, block + 1)) {
+            if (((block * bs->block_size) & ~page_mask) > sync_end) {
+                break;
+            }
+            sync_end = ((block + 1) * bs->block_size + page_mask) & ~page_mask;
+        }
+        // Clean blocks caught up in the run were clean already
+        const size_t run_end = block < last ? block : last;
+        if (msync(bs->data_blocks + sync_start, sync_end - sync_start, async ? MS_ASYNC : MS_SYNC) == 0) {
+            bitmap_reset_range(bs->dirty, run_first, run_end - run_first);
+        } else {
+            success = false;
+        }
+    }
+    return success;
+}
+
+// Ranges are size_t in here, a whole store can have 2^32 blocks
+// Discarding goes first so released blocks' dirty data doesn't get written out just to be punched
+static bool flush_blocks(block_store_t *const bs, const size_t first, const size_t count, const bool async) {
+    const bool discarded = discard_released(bs, first, count);
+    return (bs->backend == BS_BACKEND_MMAP ? map_flush_range(bs, first, count, async)
+                                           : cache_flush_range(bs, first, count, async))
+           && discarded;
+}
+
+bool block_store_flush(block_store_t *const bs, const bool async) {
+    return bs && flush_blocks(bs, 0, bs->block_count, async);
+}
+
+bool block_store_flush_range(block_store_t *const bs, const unsigned first, const unsigned count, const bool async) {
+    if (bs && first < bs->block_count && count <= bs->block_count - first) {
+        return flush_blocks(bs, first, count, async);
+    }
+    return false;
+}
+
+bool block_store_sync(block_store_t *const bs) {
+    // Async flushes leave a compressed store's map to be committed here
+    return bs && (!bs->packed_map || packed_commit(bs)) && sync_files(bs);
+}
+
+bool block_store_read_async(block_store_t *const bs, const unsigned block_id, void *const dst, const uint64_t tag) {
+    if (bs && dst && BLOCK_ACCESSIBLE(bs, block_id)) {
+        const int slot = async_claim(bs, block_id, 1, dst, tag, false);
+        if (slot == -1) {
+            return false;
+        }
+        if (bs->backend == BS_BACKEND_ASYNC && !bs->direct && !cache_find(bs, block_id)) {
+            async_queue(bs, slot);
+        } else {
+            // Nothing to wait for (or, under O_DIRECT, no way to read into an unaligned buffer)
+            // so it's done now and handed back with the next poll like everything else
+            const bool success = block_store_read(bs, block_id, dst);
+            pthread_mutex_lock(&bs->async.lock);
+            async_complete(bs, slot, success);
+            pthread_mutex_unlock(&bs->async.lock);
+        }
+        return true;
+    }
+    return false;
+}
+
+size_t block_store_poll(block_store_t *const bs, block_store_completion_t *const completions, const size_t max,
+                        const bool wait) {
+    size_t got = 0;
+    if (bs && completions) {
+        async_engine_t *const engine = &bs->async;
+        async_submit(bs);
+        for (;;) {
+            async_reap(bs, false);
+            pthread_mutex_lock(&engine->lock);
+            while (got < max && engine->done_count) {
+                const unsigned slot = engine->done[engine->done_head];
+                engine->done_head   = (engine->done_head + 1) % ASYNC_DEPTH;
+                --engine->done_count;
+                --engine->user_pending;
+                completions[got].tag     = engine->requests[slot].tag;
+                completions[got].success = engine->requests[slot].success;
+                ++got;
+                engine->free_slots[engine->free_count++] = slot;
+            }
+            const bool outstanding = engine->user_pending > engine->done_count;
+            pthread_mutex_unlock(&engine->lock);
+            if (got || !max || !wait || !outstanding) {
+                break;
+            }
+            async_reap(bs, true);
+        }
+    }
+    return got;
+}
+
+// A block's current contents, wherever they live right now: the FBM buffer or mapping, the cache, or the file
+// Goes around the cache where it can so snapshot traffic doesn't push out the origin's working set
+static bool block_contents(block_store_t *const bs, const size_t block_id, uint8_t *const dst) {
+    if (bs->backend == BS_BACKEND_MMAP || block_id < bs->fbm_blocks) {
+        memcpy(dst, bs->data_blocks + (bs->block_size * block_id), bs->block_size);
         return true;
     }
+    const cache_slot_t *const slot = bs->direct ? cache_get(bs, block_id, true) : cache_find(bs, block_id);
+    if (slot) {
+        memcpy(dst, cache_data(bs, slot), bs->block_size);
+        return true;
+    }
+    return !bs->direct && block_io(bs, false, dst, block_id, 1);
+}
+
+// Called before anything changes a block, FBM blocks included
+// Every live snapshot that doesn't have its own copy yet gets one, read from the origin only the once
+static void cow_preserve(block_store_t *const bs, const size_t block_id) {
+    const uint8_t *contents = NULL;
+    for (block_store_snapshot_t *snap = bs->snapshots; snap; snap = snap->next) {
+        if (snap->broken || bitmap_test(snap->preserved, block_id)) {
+            continue;
+        }
+        if (!contents && block_contents(bs, block_id, snap->buffer)) {
+            contents = snap->buffer;
+        }
+        if (contents
+            && file_io(snap->fd, true, (void *) contents, bs->block_size, (off_t) block_id * bs->block_size)) {
+            bitmap_set(snap->preserved, block_id);
+        } else {
+            snap->broken = true;
+        }
+    }
+}
+
+// Swaps the snapshot's copies into a chunk of the origin's image
+static bool snapshot_overlay(const block_store_snapshot_t *const snap, uint8_t *const chunk, const size_t offset,
+                             const size_t length) {
+    const size_t block_size = snap->origin->block_size;
+    for (size_t block = offset / block_size; block < (offset + length) / block_size; ++block) {
+        if (bitmap_test(snap->preserved, block)
+            && !file_io(snap->fd, false, chunk + (block * block_size - offset), block_size,
+                        (off_t) block * block_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies the image out to a new file, as it is now or as the snapshot saw it
+static bool persist_image(block_store_t *const bs, const block_store_snapshot_t *const snap,
+                          const char *const fname) {
+    bool success = false;
+    if (fname) {
+        // Anything only in the cache has to reach the backing file before it can be copied from there
+        if (bs->backend != BS_BACKEND_MMAP && !flush_blocks(bs, 0, bs->block_count, true)) {
+            return false;
+        }
+        const geometry_record_t geometry = {GEOMETRY_MAGIC, GEOMETRY_VERSION, (uint32_t) bs->block_size,
+                                            bs->block_count};
+        void *chunk;
+        const int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd != -1) {
+            if (ftruncate(fd, IMAGE_BYTES(bs) + sizeof(geometry)) != -1
+                && posix_memalign(&chunk, IO_ALIGNMENT, PERSIST_CHUNK) == 0) {
+                success = true;
+                for (size_t offset = 0; success && offset < IMAGE_BYTES(bs); offset += PERSIST_CHUNK) {
+                    const size_t length = IMAGE_BYTES(bs) - offset < PERSIST_CHUNK ? IMAGE_BYTES(bs) - offset
+                                                                                   : PERSIST_CHUNK;
+                    uint8_t *data = (uint8_t *) chunk;
+                    if (bs->backend != BS_BACKEND_MMAP) {
+                        success = block_io(bs, false, data, offset / bs->block_size, length / bs->block_size);
+                    } else if (snap) {
+                        memcpy(data, bs->data_blocks + offset, length);
+                    } else {
+                        data = bs->data_blocks + offset;
+                    }
+                    success = success && (!snap || snapshot_overlay(snap, data, offset, length));
+                    // The new file reads as zeroes already, so all-zero chunks are left as holes
+                    if (success && (data[0] || memcmp(data, data + 1, length - 1))) {
+                        success = file_io(fd, true, data, length, (off_t) offset);
+                    }
+                }
+                free(chunk);
+                success = success
+                          && pwrite(fd, &geometry, sizeof(geometry), IMAGE_BYTES(bs)) == sizeof(geometry)
+                          && fsync(fd) == 0;
+            }
+            close(fd);
+        }
+    }
+    return success;
+}
+
+bool block_store_persist(block_store_t *const bs, const char *const fname) {
+    return bs && persist_image(bs, NULL, fname);
+}
+
+block_store_snapshot_t *block_store_snapshot(block_store_t *const bs) {
+    if (bs) {
+        block_store_snapshot_t *snap = (block_store_snapshot_t *) calloc(1, sizeof(block_store_snapshot_t));
+        if (snap) {
+            const geometry_record_t geometry = {GEOMETRY_MAGIC, GEOMETRY_VERSION, (uint32_t) bs->block_size,
+                                                bs->block_count};
+            void *buffer;
+            snap->fd = create_anon(&geometry);
+            if (snap->fd != -1) {
+                snap->preserved = bitmap_create(bs->block_count);
+                if (snap->preserved && posix_memalign(&buffer, IO_ALIGNMENT, bs->block_size) == 0) {
+                    snap->buffer  = (uint8_t *) buffer;
+                    snap->origin  = bs;
+                    snap->next    = bs->snapshots;
+                    bs->snapshots = snap;
+                    return snap;
+                }
+                bitmap_destroy(snap->preserved);
+                close(snap->fd);
+            }
+            free(snap);
+        }
+    }
+    return NULL;
+}
+
+bool block_store_snapshot_read(block_store_snapshot_t *const snap, const unsigned block_id, void *const dst) {
+    if (snap && dst && snap->origin && !snap->broken && block_id < snap->origin->block_count) {
+        block_store_t *const bs = snap->origin;
+        if (bitmap_test(snap->preserved, block_id)) {
+            return file_io(snap->fd, false, dst, bs->block_size, (off_t) block_id * bs->block_size);
+        }
+        // Unchanged since the snapshot, so the origin's copy is the snapshot's copy
+        if (!bs->direct || block_id < bs->fbm_blocks) {
+            return block_contents(bs, block_id, (uint8_t *) dst);
+        }
+        // O_DIRECT can't read into an unaligned buffer
+        if (block_contents(bs, block_id, snap->buffer)) {
+            memcpy(dst, snap->buffer, bs->block_size);
+            return true;
+        }
+    }
     return false;
 }
+
+bool block_store_snapshot_persist(block_store_snapshot_t *const snap, const char *const fname) {
+    return snap && snap->origin && !snap->broken && persist_image(snap->origin, snap, fname);
+}
+
+void block_store_snapshot_close(block_store_snapshot_t *const snap) {
+    if (snap) {
+        if (snap->origin) {
+            block_store_snapshot_t **link = &snap->origin->snapshots;
+            while (*link != snap) {
+                link = &(*link)->next;
+            }
+            *link = snap->next;
+        }
+        bitmap_destroy(snap->preserved);
+        free(snap->buffer);
+        close(snap->fd);
+        free(snap);
+    }
+}
@@ -2,6 +2,7 @@
 #include <cstddef>
 #include <cstring>
 #include "gtest/gtest.h"
+#include <sys/stat.h>
 
 #include "block_store.h"
 
@@ -20,6 +21,27 @@ TEST(bs_create_close, basic) {
     block_store_close(res);
 }
 
+TEST(bs_create_close, sparse) {
+    // Format shouldn't write the data area, old contents included
+    uint8_t block[512];
+    for (int pass = 0; pass < 2; ++pass) {
+        block_store_t *bs = block_store_create("test_an.bs");
+        ASSERT_NE(nullptr, bs);
+        memset(block, 0xEE, sizeof(block));
+        ASSERT_TRUE(block_store_write(bs, 1000, block));
+        ASSERT_TRUE(block_store_flush(bs, false));
+        block_store_close(bs);
+        struct stat file_info;
+        ASSERT_EQ(0, stat("test_an.bs", &file_info));
+        ASSERT_GT(1024, file_info.st_blocks);
+    }
+    block_store_t *bs = block_store_create("test_an.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_read(bs, 1000, block));
+    ASSERT_EQ(0, block[0]);
+    block_store_close(bs);
+}
+
 TEST(bs_destroy, null_object) {
     block_store_close(NULL);
     // Congrats, you didn't crash!
@@ -44,6 +66,9 @@ TEST(bs_read, bad_values) {
 
     ASSERT_FALSE(block_store_read(NULL, block_a, block));
 
+    // or the block just past the end
+    ASSERT_FALSE(block_store_read(bs, 65536, block));
+
     block_store_close(bs);
 }
 
@@ -65,6 +90,8 @@ TEST(bs_write, bad_values) {
 
     ASSERT_FALSE(block_store_write(NULL, block_a, block));
 
+    ASSERT_FALSE(block_store_write(bs, 65536, block));
+
     block_store_close(bs);
 }
 
@@ -135,6 +162,144 @@ TEST(bs_request_release, fbm_attack) {
     block_store_close(bs);
 }
 
+TEST(bs_request_release, past_end) {
+    block_store_t *bs = block_store_create("test_ad.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 65535));
+    ASSERT_FALSE(block_store_request(bs, 65536));
+    ASSERT_FALSE(block_store_request(bs, UINT32_MAX));
+    block_store_release(bs, 65536);
+    block_store_release(bs, UINT32_MAX);
+    ASSERT_EQ(17u, block_store_used_count(bs));
+    block_store_close(bs);
+}
+
+TEST(bs_release_many, runs) {
+    block_store_t *bs = block_store_create("test_ab.bs");
+    ASSERT_NE(nullptr, bs);
+    for (unsigned i = 16; i < 65536; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+    }
+    // Runs, strays, and ids that aren't valid (the FBM, past the end)
+    const unsigned ids[] = {100, 101, 102, 103, 5, 2000, 3000, 3001, 65535, 65536, 70000};
+    ASSERT_EQ(8u, block_store_release_many(bs, ids, sizeof(ids) / sizeof(ids[0])));
+    for (unsigned i = 0; i < 9; ++i) {
+        if (ids[i] != 5) {
+            ASSERT_TRUE(block_store_request(bs, ids[i]));
+        }
+    }
+    ASSERT_FALSE(block_store_request(bs, 104));
+    ASSERT_EQ(0u, block_store_release_many(bs, NULL, 4));
+    ASSERT_EQ(0u, block_store_release_many(NULL, ids, 4));
+
+    ASSERT_TRUE(block_store_release_range(bs, 1000, 40000));
+    ASSERT_TRUE(block_store_request(bs, 1000));
+    ASSERT_TRUE(block_store_request(bs, 40999));
+    ASSERT_FALSE(block_store_request(bs, 41000));
+    ASSERT_FALSE(block_store_request(bs, 999));
+    ASSERT_EQ(1001u, block_store_allocate_near(bs, 0));
+    ASSERT_TRUE(block_store_release_range(bs, 65535, 1));
+    ASSERT_TRUE(block_store_request(bs, 65535));
+    ASSERT_FALSE(block_store_release_range(bs, 65535, 2));
+    ASSERT_FALSE(block_store_release_range(bs, 10, 10));
+    ASSERT_FALSE(block_store_release_range(bs, 100, 0));
+    ASSERT_FALSE(block_store_release_range(NULL, 100, 1));
+    block_store_close(bs);
+
+    // And it all makes it to the file
+    bs = block_store_open("test_ab.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 1001));
+    ASSERT_TRUE(block_store_request(bs, 1002));
+    ASSERT_FALSE(block_store_request(bs, 41000));
+    block_store_close(bs);
+}
+
+TEST(bs_free_count, basic_use) {
+    block_store_t *bs = block_store_create("test_ac.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(16u, block_store_used_count(bs));
+    ASSERT_EQ(65520u, block_store_free_count(bs));
+    ASSERT_EQ(65520u, block_store_largest_free_extent(bs));
+
+    ASSERT_TRUE(block_store_request(bs, 1000));
+    ASSERT_FALSE(block_store_request(bs, 1000));
+    ASSERT_NE(0u, block_store_allocate(bs));
+    unsigned ids[100];
+    ASSERT_EQ(100u, block_store_allocate_extent(bs, 100, ids));
+    ASSERT_EQ(118u, block_store_used_count(bs));
+    ASSERT_EQ(65536u - 1001, block_store_largest_free_extent(bs));
+
+    // Releasing what's already free doesn't count twice
+    block_store_release(bs, 1000);
+    block_store_release(bs, 1000);
+    ASSERT_EQ(117u, block_store_used_count(bs));
+    ASSERT_TRUE(block_store_release_range(bs, 16, 200));
+    ASSERT_EQ(16u, block_store_used_count(bs));
+    ASSERT_TRUE(block_store_request(bs, 30000));
+    ASSERT_EQ(65519u, block_store_free_count(bs));
+    ASSERT_EQ(65536u - 30001, block_store_largest_free_extent(bs));
+    block_store_close(bs);
+
+    bs = block_store_open("test_ac.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(17u, block_store_used_count(bs));
+    for (unsigned i = 16; i < 65536; ++i) {
+        block_store_request(bs, i);
+    }
+    ASSERT_EQ(0u, block_store_free_count(bs));
+    ASSERT_EQ(0u, block_store_largest_free_extent(bs));
+    block_store_close(bs);
+
+    ASSERT_EQ(0u, block_store_free_count(NULL));
+    ASSERT_EQ(0u, block_store_used_count(NULL));
+    ASSERT_EQ(0u, block_store_largest_free_extent(NULL));
+}
+
+TEST(bs_request_range, basic_use) {
+    block_store_t *bs = block_store_create("test_am.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request_range(bs, 16, 33));
+    ASSERT_EQ(49u, block_store_used_count(bs));
+    ASSERT_FALSE(block_store_request(bs, 48));
+    ASSERT_TRUE(block_store_request(bs, 49));
+
+    // All or nothing
+    ASSERT_FALSE(block_store_request_range(bs, 40, 20));
+    ASSERT_TRUE(block_store_request(bs, 55));
+    ASSERT_FALSE(block_store_request_range(bs, 50, 10));
+    ASSERT_EQ(51u, block_store_used_count(bs));
+    ASSERT_TRUE(block_store_request_range(bs, 50, 5));
+    ASSERT_TRUE(block_store_request_range(bs, 65535, 1));
+    ASSERT_FALSE(block_store_request_range(bs, 65530, 10));
+    ASSERT_FALSE(block_store_request_range(bs, 10, 10));
+    ASSERT_FALSE(block_store_request_range(bs, 100, 0));
+    ASSERT_FALSE(block_store_request_range(NULL, 100, 1));
+    ASSERT_EQ(57u, block_store_used_count(bs));
+
+    // An extent takes the free neighbours of the block it starts at
+    unsigned ids[8];
+    ASSERT_EQ(8u, block_store_allocate_extent(bs, 8, ids));
+    for (unsigned i = 0; i < 8; ++i) {
+        ASSERT_EQ(56u + i, ids[i]);
+    }
+    // Goes past a gap too small for it rather than splitting
+    ASSERT_TRUE(block_store_request(bs, 70));
+    ASSERT_EQ(8u, block_store_allocate_extent(bs, 8, ids));
+    for (unsigned i = 0; i < 8; ++i) {
+        ASSERT_EQ(71u + i, ids[i]);
+    }
+    block_store_close(bs);
+
+    bs = block_store_open("test_am.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(74u, block_store_used_count(bs));
+    ASSERT_FALSE(block_store_request(bs, 16));
+    ASSERT_FALSE(block_store_request(bs, 63));
+    ASSERT_TRUE(block_store_request(bs, 64));
+    block_store_close(bs);
+}
+
 TEST(bs_request, fill_device) {
     block_store_t *bs = block_store_create("test_l.bs");
     for (unsigned i = 16; i < 65536; ++i) {
@@ -144,6 +309,808 @@ TEST(bs_request, fill_device) {
     block_store_close(bs);
 }
 
+TEST(bs_allocate, next_fit_and_near) {
+    block_store_t *bs = block_store_create("test_m.bs");
+    ASSERT_NE(nullptr, bs);
+
+    unsigned block_a = block_store_allocate(bs);
+    unsigned block_b = block_store_allocate(bs);
+    ASSERT_EQ(block_a + 1, block_b);
+
+    // Freed blocks aren't handed right back out, the cursor keeps moving
+    block_store_release(bs, block_a);
+    ASSERT_EQ(block_b + 1, block_store_allocate(bs));
+
+    ASSERT_EQ(1000u, block_store_allocate_near(bs, 1000));
+    ASSERT_EQ(1001u, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, 1002));
+    ASSERT_EQ(1003u, block_store_allocate_near(bs, 1000));
+
+    // Wraps around when there's nothing past the hint
+    for (unsigned i = 1004; i < 65536; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+    }
+    ASSERT_EQ(block_a, block_store_allocate_near(bs, 65535));
+    ASSERT_EQ(0u, block_store_allocate_near(NULL, 1));
+
+    block_store_close(bs);
+}
+
+TEST(bs_allocate_extent, runs) {
+    block_store_t *bs = block_store_create("test_n.bs");
+    ASSERT_NE(nullptr, bs);
+
+    unsigned ids[16];
+    ASSERT_EQ(0u, block_store_allocate_extent(NULL, 16, ids));
+    ASSERT_EQ(0u, block_store_allocate_extent(bs, 16, NULL));
+
+    ASSERT_TRUE(block_store_request(bs, 20));
+    ASSERT_EQ(16u, block_store_allocate_extent(bs, 16, ids));
+    // 16-19 is too short, so all of it comes from 21 onwards
+    for (unsigned i = 0; i < 16; ++i) {
+        ASSERT_EQ(21 + i, ids[i]);
+    }
+
+    // No run long enough left, so it's pieced together (65530-65535, wrap, 16-19) and runs out partway through
+    for (unsigned i = 37; i < 65530; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+    }
+    ASSERT_EQ(10u, block_store_allocate_extent(bs, 16, ids));
+    ASSERT_EQ(65530u, ids[0]);
+    ASSERT_EQ(65535u, ids[5]);
+    ASSERT_EQ(16u, ids[6]);
+    ASSERT_EQ(19u, ids[9]);
+    ASSERT_EQ(0u, block_store_allocate_extent(bs, 16, ids));
+
+    block_store_close(bs);
+}
+
+TEST(bs_map_block, basic_use) {
+    block_store_t *bs = block_store_create("test_o.bs");
+    ASSERT_NE(nullptr, bs);
+
+    // Same rules as read/write
+    ASSERT_EQ(nullptr, block_store_map_block(NULL, 20));
+    for (unsigned i = 0; i < 16; ++i) {
+        ASSERT_EQ(nullptr, block_store_map_block(bs, i));
+        ASSERT_EQ(nullptr, block_store_map_block_writable(bs, i));
+    }
+    ASSERT_EQ(nullptr, block_store_map_block_writable(bs, 65536));
+
+    unsigned block_a = block_store_allocate(bs);
+    uint8_t *mapped  = (uint8_t *) block_store_map_block_writable(bs, block_a);
+    ASSERT_NE(nullptr, mapped);
+    memset(mapped, 0xA5, 512);
+    block_store_unmap_block(bs, block_a, true);
+
+    // Writes through the pointer are what read sees, and the other way around
+    uint8_t data_blocks[2][512];
+    memset(data_blocks[0], 0xA5, 512);
+    ASSERT_TRUE(block_store_read(bs, block_a, data_blocks[1]));
+    ASSERT_EQ(0, memcmp(data_blocks[0], data_blocks[1], 512));
+
+    memset(data_blocks[0], 0x3C, 512);
+    ASSERT_TRUE(block_store_write(bs, block_a, data_blocks[0]));
+    const void *view = block_store_map_block(bs, block_a);
+    ASSERT_NE(nullptr, view);
+    ASSERT_EQ(0, memcmp(data_blocks[0], view, 512));
+    block_store_unmap_block(bs, block_a, false);
+
+    block_store_close(bs);
+
+    // and it made it to the file
+    bs = block_store_open("test_o.bs");
+    ASSERT_NE(nullptr, bs);
+    view = block_store_map_block(bs, block_a);
+    ASSERT_EQ(0, memcmp(data_blocks[0], view, 512));
+    block_store_unmap_block(bs, block_a, false);
+    block_store_close(bs);
+}
+
+TEST(bs_readv_writev, basic_use) {
+    block_store_t *bs = block_store_create("test_p.bs");
+    ASSERT_NE(nullptr, bs);
+
+    // Two runs and a straggler
+    unsigned ids[6] = {100, 101, 102, 500, 501, 20};
+    uint8_t data_blocks[2][6 * 512];
+    for (unsigned i = 0; i < 6 * 512; ++i) {
+        data_blocks[0][i] = i / 7;
+    }
+
+    ASSERT_EQ(6u, block_store_writev(bs, ids, 6, data_blocks[0]));
+    ASSERT_EQ(6u, block_store_readv(bs, ids, 6, data_blocks[1]));
+    ASSERT_EQ(0, memcmp(data_blocks[0], data_blocks[1], 6 * 512));
+
+    // Lines up with single block reads
+    ASSERT_TRUE(block_store_read(bs, 500, data_blocks[1]));
+    ASSERT_EQ(0, memcmp(data_blocks[0] + 3 * 512, data_blocks[1], 512));
+
+    // Stops at the first bad id
+    unsigned bad_ids[3] = {200, 3, 201};
+    ASSERT_EQ(1u, block_store_writev(bs, bad_ids, 3, data_blocks[0]));
+    ASSERT_EQ(1u, block_store_readv(bs, bad_ids, 3, data_blocks[1]));
+    unsigned past_end[2] = {65535, 65536};
+    ASSERT_EQ(1u, block_store_readv(bs, past_end, 2, data_blocks[1]));
+
+    ASSERT_EQ(0u, block_store_readv(NULL, ids, 6, data_blocks[1]));
+    ASSERT_EQ(0u, block_store_readv(bs, NULL, 6, data_blocks[1]));
+    ASSERT_EQ(0u, block_store_writev(bs, ids, 6, NULL));
+
+    block_store_close(bs);
+}
+
+TEST(bs_advise, bad_values) {
+    block_store_t *bs = block_store_create("test_q.bs");
+    ASSERT_NE(nullptr, bs);
+
+    ASSERT_TRUE(block_store_advise(bs, 16, 32, BS_ADVICE_WILLNEED));
+    ASSERT_TRUE(block_store_advise(bs, 1000, 3, BS_ADVICE_SEQUENTIAL));
+    ASSERT_TRUE(block_store_advise(bs, 65535, 1, BS_ADVICE_RANDOM));
+
+    ASSERT_FALSE(block_store_advise(NULL, 16, 32, BS_ADVICE_WILLNEED));
+    ASSERT_FALSE(block_store_advise(bs, 16, 0, BS_ADVICE_WILLNEED));
+    ASSERT_FALSE(block_store_advise(bs, 65535, 2, BS_ADVICE_WILLNEED));
+    ASSERT_FALSE(block_store_advise(bs, 65536, 1, BS_ADVICE_WILLNEED));
+    ASSERT_FALSE(block_store_advise(bs, 16, 32, (block_store_advice_t) 42));
+
+    // Advice doesn't touch contents
+    uint8_t data_blocks[2][512];
+    memset(data_blocks[0], 0x42, 512);
+    ASSERT_TRUE(block_store_write(bs, 1000, data_blocks[0]));
+    ASSERT_TRUE(block_store_advise(bs, 1000, 1, BS_ADVICE_DONTNEED));
+    ASSERT_TRUE(block_store_read(bs, 1000, data_blocks[1]));
+    ASSERT_EQ(0, memcmp(data_blocks[0], data_blocks[1], 512));
+
+    block_store_close(bs);
+}
+
+TEST(bs_flush, basic_use) {
+    block_store_t *bs = block_store_create("test_r.bs");
+    ASSERT_NE(nullptr, bs);
+
+    // Nothing dirty is fine too
+    ASSERT_TRUE(block_store_flush(bs, false));
+    ASSERT_TRUE(block_store_flush(bs, false));
+
+    uint8_t data_blocks[2][512];
+    memset(data_blocks[0], 0x77, 512);
+    unsigned ids[3] = {100, 101, 9000};
+    ASSERT_TRUE(block_store_request(bs, 100));
+    ASSERT_TRUE(block_store_write(bs, 100, data_blocks[0]));
+    ASSERT_TRUE(block_store_write(bs, 101, data_blocks[0]));
+    ASSERT_TRUE(block_store_write(bs, 9000, data_blocks[0]));
+    ASSERT_TRUE(block_store_flush_range(bs, 100, 2, false));
+    ASSERT_TRUE(block_store_flush_range(bs, 0, 16, true));
+    ASSERT_TRUE(block_store_flush(bs, false));
+    ASSERT_EQ(1u, block_store_writev(bs, ids, 1, data_blocks[0]));
+    ASSERT_TRUE(block_store_flush(bs, true));
+    ASSERT_TRUE(block_store_sync(bs));
+    ASSERT_FALSE(block_store_sync(NULL));
+
+    ASSERT_FALSE(block_store_flush(NULL, false));
+    ASSERT_FALSE(block_store_flush_range(NULL, 0, 16, false));
+    ASSERT_FALSE(block_store_flush_range(bs, 65536, 1, false));
+    ASSERT_FALSE(block_store_flush_range(bs, 65530, 7, false));
+    ASSERT_TRUE(block_store_flush_range(bs, 65530, 6, false));
+
+    block_store_close(bs);
+
+    // Made it to the file, FBM included
+    bs = block_store_open("test_r.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 100));
+    ASSERT_TRUE(block_store_read(bs, 9000, data_blocks[1]));
+    ASSERT_EQ(0, memcmp(data_blocks[0], data_blocks[1], 512));
+    block_store_close(bs);
+}
+
+TEST(bs_pread_backend, basic_use) {
+    // Tiny cache so evictions and pinning actually get exercised
+    block_store_config_t config = {BS_BACKEND_PREAD, 8, false, 0, 0, false, false, false, false};
+    block_store_t *bs = block_store_create_config("test_s.bs", &config);
+    ASSERT_NE(nullptr, bs);
+
+    uint8_t data[4 * 512];
+    for (unsigned i = 0; i < 4; ++i) {
+        memset(data + 512 * i, 0x10 + i, 512);
+    }
+
+    // Through the cache, more blocks than it can hold
+    for (unsigned id = 100; id < 164; ++id) {
+        ASSERT_EQ(id, block_store_allocate_near(bs, id));
+        ASSERT_TRUE(block_store_write(bs, id, data + 512 * (id & 3)));
+    }
+    uint8_t buffer[4 * 512];
+    for (unsigned id = 100; id < 164; ++id) {
+        ASSERT_TRUE(block_store_read(bs, id, buffer));
+        ASSERT_EQ(0, memcmp(data + 512 * (id & 3), buffer, 512));
+    }
+
+    // Vectored, mixing cached and uncached blocks
+    unsigned ids[4] = {162, 163, 2000, 2001};
+    ASSERT_EQ(4u, block_store_writev(bs, ids, 4, data));
+    ASSERT_EQ(4u, block_store_readv(bs, ids, 4, buffer));
+    ASSERT_EQ(0, memcmp(data, buffer, 4 * 512));
+
+    // Pinned blocks stay put while others churn through the same set
+    uint8_t *const pinned = (uint8_t *) block_store_map_block_writable(bs, 3000);
+    ASSERT_NE(nullptr, pinned);
+    memset(pinned, 0xAB, 512);
+    for (unsigned id = 3002; id < 3100; id += 2) {
+        ASSERT_TRUE(block_store_read(bs, id, buffer));
+    }
+    ASSERT_EQ(0xAB, pinned[511]);
+    block_store_unmap_block(bs, 3000, true);
+
+    ASSERT_TRUE(block_store_advise(bs, 100, 64, BS_ADVICE_SEQUENTIAL));
+    ASSERT_TRUE(block_store_flush(bs, false));
+    block_store_close(bs);
+
+    // Same file through the mapping
+    bs = block_store_open("test_s.bs");
+    ASSERT_NE(nullptr, bs);
+    for (unsigned id = 100; id < 162; ++id) {
+        ASSERT_TRUE(block_store_read(bs, id, buffer));
+        ASSERT_EQ(0, memcmp(data + 512 * (id & 3), buffer, 512));
+    }
+    ASSERT_EQ(4u, block_store_readv(bs, ids, 4, buffer));
+    ASSERT_EQ(0, memcmp(data, buffer, 4 * 512));
+    const uint8_t *const mapped = (const uint8_t *) block_store_map_block(bs, 3000);
+    ASSERT_NE(nullptr, mapped);
+    ASSERT_EQ(0xAB, mapped[0]);
+    block_store_unmap_block(bs, 3000, false);
+    ASSERT_FALSE(block_store_request(bs, 163));
+    block_store_close(bs);
+
+    // And back, the FBM has to come along too
+    bs = block_store_open_config("test_s.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 100));
+    ASSERT_TRUE(block_store_request(bs, 164));
+    ASSERT_FALSE(block_store_read(bs, 65536, buffer));
+    ASSERT_FALSE(block_store_write(bs, 65536, buffer));
+    block_store_close(bs);
+
+    // O_DIRECT doesn't work on every filesystem, but where it does it has to behave
+    config.direct = true;
+    bs = block_store_create_config("test_t.bs", &config);
+    if (bs) {
+        ASSERT_EQ(4u, block_store_writev(bs, ids, 4, data));
+        block_store_close(bs);
+        bs = block_store_open_config("test_t.bs", &config);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_EQ(4u, block_store_readv(bs, ids, 4, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, 4 * 512));
+        block_store_close(bs);
+    }
+
+    // Direct only makes sense without the mapping
+    config.backend = BS_BACKEND_MMAP;
+    ASSERT_EQ(nullptr, block_store_create_config("test_t.bs", &config));
+}
+
+TEST(bs_read_async, basic_use) {
+    uint8_t data[8 * 512];
+    for (unsigned i = 0; i < 8; ++i) {
+        memset(data + 512 * i, 0x30 + i, 512);
+    }
+    unsigned ids[8] = {200, 201, 202, 300, 301, 5000, 6000, 6001};
+    // Written through the mapping, read back through each backend
+    block_store_t *bs = block_store_create("test_u.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(8u, block_store_writev(bs, ids, 8, data));
+    block_store_close(bs);
+
+    const block_store_backend_t backends[] = {BS_BACKEND_MMAP, BS_BACKEND_PREAD, BS_BACKEND_ASYNC};
+    for (const block_store_backend_t backend : backends) {
+        block_store_config_t config = {backend, 0, false, 0, 0, false, false, false, false};
+        bs = block_store_open_config("test_u.bs", &config);
+        ASSERT_NE(nullptr, bs);
+
+        uint8_t buffer[8 * 512];
+        memset(buffer, 0, sizeof(buffer));
+        for (unsigned i = 0; i < 8; ++i) {
+            ASSERT_TRUE(block_store_read_async(bs, ids[i], buffer + 512 * i, i));
+        }
+        ASSERT_FALSE(block_store_read_async(bs, 5, buffer, 0));
+        ASSERT_FALSE(block_store_read_async(bs, 65536, buffer, 0));
+        ASSERT_FALSE(block_store_read_async(bs, 200, NULL, 0));
+        ASSERT_FALSE(block_store_read_async(NULL, 200, buffer, 0));
+
+        block_store_completion_t completions[8];
+        bool seen[8] = {false};
+        size_t got = 0;
+        while (got < 8) {
+            size_t polled = block_store_poll(bs, completions, 3, true);
+            ASSERT_NE(0u, polled);
+            ASSERT_GE(3u, polled);
+            for (size_t i = 0; i < polled; ++i) {
+                ASSERT_GT(8u, completions[i].tag);
+                ASSERT_FALSE(seen[completions[i].tag]);
+                ASSERT_TRUE(completions[i].success);
+                seen[completions[i].tag] = true;
+            }
+            got += polled;
+        }
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        // Nothing left, so no waiting either
+        ASSERT_EQ(0u, block_store_poll(bs, completions, 8, true));
+        ASSERT_EQ(0u, block_store_poll(NULL, completions, 8, true));
+
+        // More than fit at once
+        unsigned filled = 0;
+        while (block_store_read_async(bs, 200, buffer, filled)) {
+            ++filled;
+        }
+        ASSERT_EQ(64u, filled);
+        while (filled) {
+            filled -= block_store_poll(bs, completions, 8, true);
+        }
+
+        // readv with its runs in flight together, around a cached block
+        memset(buffer, 0, sizeof(buffer));
+        ASSERT_TRUE(block_store_read(bs, 300, buffer));
+        ASSERT_EQ(8u, block_store_readv(bs, ids, 8, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+
+        // Left queued on purpose, close has to cope
+        ASSERT_TRUE(block_store_read_async(bs, 6000, buffer, 0));
+        block_store_close(bs);
+    }
+}
+
+TEST(bs_geometry, basic_use) {
+    // 4 KiB blocks, 5000 of them, so the FBM is 1 block
+    block_store_config_t config = {BS_BACKEND_MMAP, 0, false, 4096, 5000, false, false, false, false};
+    block_store_t *bs = block_store_create_config("test_v.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4096u, block_store_get_block_size(bs));
+    ASSERT_EQ(5000u, block_store_get_block_count(bs));
+    ASSERT_EQ(1u, block_store_allocate(bs));
+    uint8_t data[4096], buffer[4096];
+    memset(data, 0x5A, sizeof(data));
+    ASSERT_FALSE(block_store_write(bs, 0, data));
+    ASSERT_TRUE(block_store_write(bs, 4999, data));
+    block_store_close(bs);
+
+    // Geometry comes off the disk, whatever the backend
+    const block_store_backend_t backends[] = {BS_BACKEND_MMAP, BS_BACKEND_PREAD};
+    unsigned next_free = 2;
+    for (const block_store_backend_t backend : backends) {
+        block_store_config_t open_config = {backend, 0, false, 512, 100, false, false, false, false};
+        bs = block_store_open_config("test_v.bs", &open_config);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_EQ(4096u, block_store_get_block_size(bs));
+        ASSERT_EQ(5000u, block_store_get_block_count(bs));
+        ASSERT_TRUE(block_store_read(bs, 4999, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        ASSERT_FALSE(block_store_request(bs, 1));
+        ASSERT_EQ(next_free++, block_store_allocate(bs));
+        block_store_close(bs);
+    }
+
+    // 512 byte blocks, 5000 of them, takes 2 FBM blocks
+    config.block_size = 512;
+    bs = block_store_create_config("test_v.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_read(bs, 1, buffer));
+    ASSERT_EQ(2u, block_store_allocate(bs));
+    block_store_close(bs);
+
+    // 64 KiB blocks through the cache
+    config = {BS_BACKEND_PREAD, 0, false, 65536, 64, false, false, false, false};
+    bs = block_store_create_config("test_v.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    uint8_t *big = new uint8_t[65536 * 2];
+    memset(big, 0xC3, 65536 * 2);
+    unsigned ids[2] = {62, 63};
+    ASSERT_EQ(2u, block_store_writev(bs, ids, 2, big));
+    ASSERT_TRUE(block_store_write(bs, 10, big));
+    block_store_close(bs);
+    bs = block_store_open("test_v.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(65536u, block_store_get_block_size(bs));
+    memset(big, 0, 65536 * 2);
+    ASSERT_EQ(2u, block_store_readv(bs, ids, 2, big));
+    ASSERT_EQ(0xC3, big[65536 * 2 - 1]);
+    ASSERT_TRUE(block_store_read(bs, 10, big));
+    ASSERT_EQ(0xC3, big[65535]);
+    delete[] big;
+    block_store_close(bs);
+
+    // Not powers of two, too big, too small, or nothing left once the FBM's in
+    const size_t bad[][2] = {{1000, 100}, {256, 100}, {131072, 100}, {512, 1}, {512, 0x100000001ULL}};
+    for (const auto &geometry : bad) {
+        block_store_config_t bad_config = {BS_BACKEND_MMAP, 0, false, geometry[0], geometry[1], false, false, false, false};
+        ASSERT_EQ(nullptr, block_store_create_config("test_w.bs", &bad_config));
+    }
+
+    ASSERT_EQ(0u, block_store_get_block_size(NULL));
+    ASSERT_EQ(0u, block_store_get_block_count(NULL));
+}
+
+TEST(bs_geometry, unrecorded_default) {
+    // Images from before the geometry record are exactly the default size, and open as such
+    FILE *image = fopen("test_x.bs", "w");
+    ASSERT_NE(nullptr, image);
+    fclose(image);
+    ASSERT_EQ(0, truncate("test_x.bs", 65536 * 512));
+    block_store_t *bs = block_store_open("test_x.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(512u, block_store_get_block_size(bs));
+    ASSERT_EQ(65536u, block_store_get_block_count(bs));
+    block_store_close(bs);
+
+    // Anything else isn't a block_store
+    ASSERT_EQ(0, truncate("test_x.bs", 65536 * 512 + 100));
+    ASSERT_EQ(nullptr, block_store_open("test_x.bs"));
+}
+
+TEST(bs_prefault, basic_use) {
+    block_store_t *bs = block_store_create("test_y.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0u, block_store_get_prefaulted(bs));
+    uint8_t data[512], buffer[512];
+    memset(data, 0x99, sizeof(data));
+    ASSERT_TRUE(block_store_write(bs, 60000, data));
+    block_store_close(bs);
+
+    for (const bool huge_pages : {false, true}) {
+        block_store_config_t config = {BS_BACKEND_MMAP, 0, false, 0, 0, true, huge_pages, false, false};
+        bs = block_store_open_config("test_y.bs", &config);
+        ASSERT_NE(nullptr, bs);
+        // At least a fault for each 2 MiB of a 32 MiB image, however big the pages ended up
+        ASSERT_LE(16u, block_store_get_prefaulted(bs));
+        ASSERT_TRUE(block_store_read(bs, 60000, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        block_store_close(bs);
+    }
+
+    // Nothing to count for the others
+    block_store_config_t config = {BS_BACKEND_PREAD, 0, false, 0, 0, true, false, false, false};
+    bs = block_store_open_config("test_y.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0u, block_store_get_prefaulted(bs));
+    ASSERT_TRUE(block_store_read(bs, 60000, buffer));
+    ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+    block_store_close(bs);
+
+    ASSERT_EQ(0u, block_store_get_prefaulted(NULL));
+}
+
+TEST(bs_create_anon, persist) {
+    block_store_t *bs = block_store_create_anon();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(512u, block_store_get_block_size(bs));
+    uint8_t data[512], buffer[512];
+    memset(data, 0x42, sizeof(data));
+    ASSERT_TRUE(block_store_read(bs, 40000, buffer));
+    for (unsigned i = 0; i < 512; ++i) {
+        ASSERT_EQ(0, buffer[i]);
+    }
+    unsigned block = block_store_allocate(bs);
+    ASSERT_EQ(16u, block);
+    ASSERT_TRUE(block_store_write(bs, block, data));
+    ASSERT_TRUE(block_store_write(bs, 65535, data));
+
+    ASSERT_TRUE(block_store_persist(bs, "test_z.bs"));
+    // Still good to use afterwards
+    ASSERT_TRUE(block_store_write(bs, 30000, data));
+    block_store_close(bs);
+
+    bs = block_store_open("test_z.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 16));
+    ASSERT_TRUE(block_store_read(bs, 65535, buffer));
+    ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+    ASSERT_TRUE(block_store_read(bs, 30000, buffer));
+    ASSERT_EQ(0, buffer[0]);
+    // And a file backed one through the cache
+    block_store_close(bs);
+    block_store_config_t config = {BS_BACKEND_PREAD, 0, false, 0, 0, false, false, false, false};
+    bs = block_store_open_config("test_z.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_write(bs, 20000, data));
+    ASSERT_TRUE(block_store_persist(bs, "test_z2.bs"));
+    block_store_close(bs);
+    bs = block_store_open("test_z2.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_read(bs, 20000, buffer));
+    ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+    ASSERT_FALSE(block_store_request(bs, 16));
+    block_store_close(bs);
+
+    // Other geometries, but no O_DIRECT for memory
+    config = {BS_BACKEND_MMAP, 0, false, 4096, 100, false, false, false, false};
+    bs = block_store_create_anon_config(&config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4096u, block_store_get_block_size(bs));
+    ASSERT_FALSE(block_store_persist(bs, NULL));
+    ASSERT_FALSE(block_store_persist(NULL, "test_z.bs"));
+    block_store_close(bs);
+    config = {BS_BACKEND_PREAD, 0, true, 0, 0, false, false, false, false};
+    ASSERT_EQ(nullptr, block_store_create_anon_config(&config));
+}
+
+TEST(bs_discard, basic_use) {
+    const block_store_backend_t backends[] = {BS_BACKEND_MMAP, BS_BACKEND_PREAD};
+    for (const block_store_backend_t backend : backends) {
+        block_store_config_t config = {backend, 0, false, 0, 0, false, false, true, false};
+        block_store_t *bs = block_store_create_config("test_aa.bs", &config);
+        ASSERT_NE(nullptr, bs);
+        uint8_t data[512], buffer[512];
+        memset(data, 0x5A, sizeof(data));
+        for (unsigned id = 1000; id < 3000; ++id) {
+            ASSERT_TRUE(block_store_request(bs, id));
+            ASSERT_TRUE(block_store_write(bs, id, data));
+        }
+        ASSERT_TRUE(block_store_flush(bs, false));
+        struct stat file_info;
+        ASSERT_EQ(0, stat("test_aa.bs", &file_info));
+        const blkcnt_t written = file_info.st_blocks;
+        ASSERT_LE(2000, written);
+
+        // Under a batch sits until a flush, and blocks taken again in between keep their data
+        for (unsigned id = 1000; id < 1500; ++id) {
+            block_store_release(bs, id);
+        }
+        ASSERT_TRUE(block_store_request(bs, 1200));
+        ASSERT_EQ(0, stat("test_aa.bs", &file_info));
+        ASSERT_EQ(written, file_info.st_blocks);
+        ASSERT_TRUE(block_store_flush(bs, false));
+        ASSERT_EQ(0, stat("test_aa.bs", &file_info));
+        ASSERT_GT(written - 400, file_info.st_blocks);
+        ASSERT_TRUE(block_store_read(bs, 1200, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        ASSERT_TRUE(block_store_read(bs, 1100, buffer));
+        ASSERT_EQ(0, buffer[0]);
+
+        // A full batch goes without one
+        for (unsigned id = 1500; id < 3000; ++id) {
+            block_store_release(bs, id);
+        }
+        ASSERT_EQ(0, stat("test_aa.bs", &file_info));
+        ASSERT_GT(written - 1200, file_info.st_blocks);
+        block_store_close(bs);
+
+        bs = block_store_open("test_aa.bs");
+        ASSERT_NE(nullptr, bs);
+        ASSERT_FALSE(block_store_request(bs, 1200));
+        ASSERT_TRUE(block_store_request(bs, 2999));
+        ASSERT_TRUE(block_store_read(bs, 2999, buffer));
+        ASSERT_EQ(0, buffer[0]);
+        block_store_close(bs);
+    }
+}
+
+TEST(bs_snapshot, basic_use) {
+    const block_store_backend_t backends[] = {BS_BACKEND_MMAP, BS_BACKEND_PREAD};
+    for (const block_store_backend_t backend : backends) {
+        block_store_config_t config = {backend, 8, false, 0, 0, false, false, false, false};
+        block_store_t *bs = block_store_create_config("test_ae.bs", &config);
+        ASSERT_NE(nullptr, bs);
+        uint8_t before[4 * 512], after[4 * 512], buffer[4 * 512];
+        memset(before, 0x11, sizeof(before));
+        memset(after, 0x22, sizeof(after));
+        unsigned ids[4] = {500, 501, 502, 9000};
+        for (unsigned i = 0; i < 4; ++i) {
+            ASSERT_TRUE(block_store_request(bs, ids[i]));
+        }
+        ASSERT_EQ(4u, block_store_writev(bs, ids, 4, before));
+
+        block_store_snapshot_t *snap = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snap);
+        // Every way of changing a block
+        ASSERT_TRUE(block_store_write(bs, 500, after));
+        ASSERT_EQ(2u, block_store_writev(bs, ids + 1, 2, after));
+        uint8_t *const mapped = (uint8_t *) block_store_map_block_writable(bs, 9000);
+        ASSERT_NE(nullptr, mapped);
+        memset(mapped, 0x22, 512);
+        block_store_unmap_block(bs, 9000, true);
+        block_store_release(bs, 500);
+        ASSERT_TRUE(block_store_request(bs, 600));
+        ASSERT_TRUE(block_store_write(bs, 600, after));
+        block_store_snapshot_t *later = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, later);
+        ASSERT_TRUE(block_store_write(bs, 600, before));
+
+        for (unsigned i = 0; i < 4; ++i) {
+            ASSERT_TRUE(block_store_snapshot_read(snap, ids[i], buffer));
+            ASSERT_EQ(0, memcmp(before, buffer, 512));
+            ASSERT_TRUE(block_store_read(bs, ids[i], buffer));
+            ASSERT_EQ(0, memcmp(after, buffer, 512));
+        }
+        ASSERT_TRUE(block_store_snapshot_read(snap, 600, buffer));
+        ASSERT_EQ(0, buffer[0]);
+        ASSERT_TRUE(block_store_snapshot_read(later, 600, buffer));
+        ASSERT_EQ(0, memcmp(after, buffer, 512));
+        ASSERT_FALSE(block_store_snapshot_read(snap, 65536, buffer));
+        block_store_snapshot_close(later);
+
+        // Saved, the snapshot is a store of its own, FBM and all
+        ASSERT_TRUE(block_store_snapshot_persist(snap, "test_af.bs"));
+        block_store_t *saved = block_store_open("test_af.bs");
+        ASSERT_NE(nullptr, saved);
+        ASSERT_EQ(20u, block_store_used_count(saved));
+        ASSERT_FALSE(block_store_request(saved, 500));
+        ASSERT_TRUE(block_store_request(saved, 600));
+        ASSERT_EQ(4u, block_store_readv(saved, ids, 4, buffer));
+        ASSERT_EQ(0, memcmp(before, buffer, sizeof(buffer)));
+        block_store_close(saved);
+
+        // Outliving the store it came from
+        block_store_close(bs);
+        ASSERT_FALSE(block_store_snapshot_read(snap, 500, buffer));
+        ASSERT_FALSE(block_store_snapshot_persist(snap, "test_af.bs"));
+        block_store_snapshot_close(snap);
+    }
+    ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+    ASSERT_FALSE(block_store_snapshot_read(NULL, 500, NULL));
+    block_store_snapshot_close(NULL);
+}
+
+TEST(bs_striped, basic_use) {
+    const char *const fnames[] = {"test_ag.bs", "test_ah.bs", "test_ai.bs"};
+    const char *const swapped[] = {"test_ah.bs", "test_ag.bs", "test_ai.bs"};
+    const block_store_backend_t backends[] = {BS_BACKEND_PREAD, BS_BACKEND_ASYNC};
+    for (const block_store_backend_t backend : backends) {
+        block_store_config_t config = {backend, 8, false, 0, 0, false, false, false, false};
+        block_store_t *bs = block_store_create_striped(fnames, 3, 4, &config);
+        ASSERT_NE(nullptr, bs);
+        // A run crossing several stripe units, and so all three files
+        unsigned ids[20];
+        uint8_t data[20 * 512], buffer[20 * 512];
+        for (unsigned i = 0; i < 20; ++i) {
+            ids[i] = 1000 + i;
+            ASSERT_TRUE(block_store_request(bs, ids[i]));
+            memset(data + i * 512, (int) i + 1, 512);
+        }
+        ASSERT_EQ(20u, block_store_writev(bs, ids, 20, data));
+        ASSERT_TRUE(block_store_write(bs, 65535, data));
+        ASSERT_EQ(20u, block_store_readv(bs, ids, 20, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        ASSERT_TRUE(block_store_flush(bs, true));
+        block_store_close(bs);
+
+        // The members only make sense together, and in order
+        ASSERT_EQ(nullptr, block_store_open(fnames[1]));
+        ASSERT_EQ(nullptr, block_store_open_striped(swapped, 3, &config));
+        ASSERT_EQ(nullptr, block_store_open_striped(fnames, 2, &config));
+        bs = block_store_open_striped(fnames, 3, &config);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_FALSE(block_store_request(bs, 1005));
+        memset(buffer, 0, sizeof(buffer));
+        ASSERT_EQ(20u, block_store_readv(bs, ids, 20, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        ASSERT_TRUE(block_store_read(bs, 65535, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, 512));
+
+        // Saved, it's a plain single-file store
+        ASSERT_TRUE(block_store_persist(bs, "test_aj.bs"));
+        block_store_close(bs);
+        block_store_t *saved = block_store_open("test_aj.bs");
+        ASSERT_NE(nullptr, saved);
+        ASSERT_FALSE(block_store_request(saved, 1019));
+        ASSERT_EQ(20u, block_store_readv(saved, ids, 20, buffer));
+        ASSERT_EQ(0, memcmp(data, buffer, sizeof(buffer)));
+        block_store_close(saved);
+    }
+    block_store_config_t mapped = {BS_BACKEND_MMAP, 0, false, 0, 0, false, false, false, false};
+    ASSERT_EQ(nullptr, block_store_create_striped(fnames, 3, 4, &mapped));
+    ASSERT_EQ(nullptr, block_store_create_striped(NULL, 3, 4, NULL));
+    ASSERT_EQ(nullptr, block_store_open_striped(NULL, 3, NULL));
+}
+
+TEST(bs_compress, basic_use) {
+    block_store_config_t config = {BS_BACKEND_ASYNC, 8, false, 0, 0, false, false, true, true};
+    block_store_t *bs = block_store_create_config("test_ak.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    // Text-like blocks that compress well, and a few random ones that won't compress at all
+    static uint8_t data[320][512];
+    uint8_t buffer[512];
+    srand(20);
+    for (unsigned i = 0; i < 320; ++i) {
+        for (unsigned byte = 0; byte < 512; ++byte) {
+            data[i][byte] = i < 300 ? (uint8_t) ("block store "[byte % 12] + (byte / 64) + i) : (uint8_t) rand();
+        }
+        ASSERT_TRUE(block_store_request(bs, 1000 + i));
+        ASSERT_TRUE(block_store_write(bs, 1000 + i, data[i]));
+    }
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_TRUE(block_store_request(bs, 2000));
+    ASSERT_TRUE(block_store_write(bs, 2000, buffer));
+
+    // Async flushes write the records but leave the map for block_store_sync
+    ASSERT_TRUE(block_store_flush(bs, true));
+    block_store_t *other = block_store_open("test_ak.bs");
+    ASSERT_NE(nullptr, other);
+    ASSERT_TRUE(block_store_read(other, 1000, buffer));
+    ASSERT_EQ(0, buffer[0]);
+    block_store_close(other);
+    ASSERT_TRUE(block_store_sync(bs));
+    other = block_store_open("test_ak.bs");
+    ASSERT_NE(nullptr, other);
+    ASSERT_TRUE(block_store_read(other, 1000, buffer));
+    ASSERT_EQ(0, memcmp(data[0], buffer, 512));
+    block_store_close(other);
+    for (unsigned i = 0; i < 320; ++i) {
+        ASSERT_TRUE(block_store_read(bs, 1000 + i, buffer));
+        ASSERT_EQ(0, memcmp(data[i], buffer, 512));
+    }
+    ASSERT_TRUE(block_store_flush(bs, false));
+    // The map of 65536 entries, plus nowhere near 320 blocks' worth of records
+    ASSERT_LT(block_store_get_stored_bytes(bs), 65536u * 8 + 320 * 512 / 2);
+    block_store_close(bs);
+
+    // Opening finds out from the file, mmap or not
+    bs = block_store_open("test_ak.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 1319));
+    ASSERT_TRUE(block_store_request(bs, 1320));
+    unsigned ids[320];
+    static uint8_t all[320 * 512];
+    for (unsigned i = 0; i < 320; ++i) {
+        ids[i] = 1000 + i;
+    }
+    ASSERT_EQ(320u, block_store_readv(bs, ids, 320, all));
+    ASSERT_EQ(0, memcmp(data, all, sizeof(all)));
+    ASSERT_TRUE(block_store_read(bs, 2000, buffer));
+    ASSERT_EQ(0, buffer[0]);
+    ASSERT_EQ(0, memcmp(buffer, buffer + 1, 511));
+
+    // Overwriting leaves dead records behind, enough of them and a flush compacts the log
+    for (unsigned round = 0; round < 8; ++round) {
+        for (unsigned i = 0; i < 320; ++i) {
+            for (unsigned byte = 0; byte < 512; ++byte) {
+                data[i][byte] = (uint8_t) rand();
+            }
+        }
+        ASSERT_EQ(320u, block_store_writev(bs, ids, 320, data));
+        ASSERT_TRUE(block_store_flush(bs, false));
+    }
+    ASSERT_LT(block_store_get_stored_bytes(bs), 2u * 1024 * 1024);
+    struct stat file_info;
+    ASSERT_EQ(0, stat("test_ak.bs", &file_info));
+    ASSERT_LT(file_info.st_size, 2 * 1024 * 1024);
+    ASSERT_TRUE(block_store_persist(bs, "test_al.bs"));
+    block_store_close(bs);
+
+    bs = block_store_open_config("test_ak.bs", &config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(320u, block_store_readv(bs, ids, 320, all));
+    ASSERT_EQ(0, memcmp(data, all, sizeof(all)));
+    block_store_close(bs);
+    // Persisting unpacks it into a plain image
+    bs = block_store_open("test_al.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(65536u * 512, block_store_get_stored_bytes(bs));
+    ASSERT_EQ(320u, block_store_readv(bs, ids, 320, all));
+    ASSERT_EQ(0, memcmp(data, all, sizeof(all)));
+    block_store_close(bs);
+
+    // In memory, with discard mode dropping released blocks' records
+    config = {BS_BACKEND_PREAD, 8, false, 0, 0, false, false, true, true};
+    bs = block_store_create_anon_config(&config);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 1000));
+    ASSERT_TRUE(block_store_write(bs, 1000, data[0]));
+    ASSERT_TRUE(block_store_flush(bs, false));
+    block_store_release(bs, 1000);
+    ASSERT_TRUE(block_store_flush(bs, false));
+    ASSERT_TRUE(block_store_request(bs, 1000));
+    ASSERT_TRUE(block_store_read(bs, 1000, buffer));
+    ASSERT_EQ(0, buffer[0]);
+    ASSERT_EQ(0, memcmp(buffer, buffer + 1, 511));
+    block_store_close(bs);
+
+    config = {BS_BACKEND_MMAP, 0, false, 0, 0, false, false, false, true};
+    ASSERT_EQ(nullptr, block_store_create_config("test_ak.bs", &config));
+    config = {BS_BACKEND_PREAD, 0, true, 0, 0, false, false, false, true};
+    ASSERT_EQ(nullptr, block_store_create_config("test_ak.bs", &config));
+    ASSERT_EQ(0u, block_store_get_stored_bytes(NULL));
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
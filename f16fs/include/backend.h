@@ -21,7 +21,9 @@
 
 #define DESCRIPTOR_MAX (256)
 
-#define BLOCK_SIZE (512)
+// The on-disk structures below are laid out for the block_store's default geometry
+// (block_ptr_t can't address any more blocks than that anyway), so format asks for exactly that and mount checks for it
+#define BLOCK_SIZE (BLOCK_STORE_DEFAULT_BLOCK_SIZE)
 
 #define INODE_BLOCK_TOTAL (32)
 
@@ -29,7 +31,8 @@
 
 #define INODE_TOTAL (((INODE_BLOCK_TOTAL) * (BLOCK_SIZE)) / sizeof(inode_t))
 
-#define INODE_BLOCK_OFFSET (16)
+// Inode table starts right after the FBM
+#define INODE_BLOCK_OFFSET (BLOCK_STORE_FBM_BLOCKS(BLOCK_SIZE, DATA_BLOCK_MAX))
 
 #define DATA_BLOCK_OFFSET ((INODE_BLOCK_OFFSET) + (INODE_BLOCK_TOTAL))
 
@@ -45,7 +48,13 @@
 
 #define FILE_SIZE_MAX ((DIRECT_TOTAL + INDIRECT_TOTAL + DBL_INDIRECT_TOTAL) * BLOCK_SIZE)
 
-#define DATA_BLOCK_MAX (65536)
+#define DATA_BLOCK_MAX (BLOCK_STORE_DEFAULT_BLOCK_COUNT)
+
+// Most blocks get_block_ptrs will grab from block_store in one extent
+#define EXTENT_POOL_MAX (64)
+
+// Reads at least this many blocks long are treated as streaming and read ahead
+#define STREAM_ADVISE_MIN (32)
 
 // Calcs what block an inode is in
 #define INODE_TO_BLOCK(inode) (((inode) >> 3) + INODE_BLOCK_OFFSET)
@@ -56,10 +65,10 @@
 #define INODE_INNER_OFFSET(inode) (INODE_INNER_IDX(inode) * sizeof(inode_t))
 
 // Converts a file position to a block index (note: not a block id. index 6 is the 6th block of the file)
-#define POSITION_TO_BLOCK_INDEX(position) ((position) >> 10)
+#define POSITION_TO_BLOCK_INDEX(position) ((position) / BLOCK_SIZE)
 
 // Position within a block
-#define POSITION_TO_INNER_OFFSET(position) ((position) &0x3FF)
+#define POSITION_TO_INNER_OFFSET(position) ((position) % BLOCK_SIZE)
 
 // Checks that an inode is the specified type
 #define INODE_IS_TYPE(inode_ptr, file_type) ((inode_ptr)->mdata.type & (file_type))
@@ -172,8 +181,12 @@ void scan_directory(const F16FS_t *const fs, const char *fname, const inode_ptr_
 
 inode_ptr_t find_free_inode(const F16FS_t *const fs);
 
-F16FS_t *ready_file(const char *path, const bool format);
+F16FS_t *ready_file(const char *path, const bool format, const block_store_config_t *config);
 
 void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, size_t pos, size_t num_of_blocks);
 
+void advise_stream(F16FS_t *fs, const unsigned *block_ids, size_t count);
+
+bool flush_file(F16FS_t *fs, const inode_t *file_inode);
+
 #endif
\ No newline at end of file
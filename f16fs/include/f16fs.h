@@ -5,6 +5,7 @@ extern "C" {
 #endif
 #include <sys/types.h>
 #include <dyn_array.h>
+#include <block_store.h>
 typedef struct F16FS F16FS_t;
 typedef enum { FS_SEEK_SET, FS_SEEK_CUR, FS_SEEK_END } seek_t;
 typedef enum { FS_REGULAR, FS_DIRECTORY } file_t;
@@ -16,6 +17,11 @@ typedef struct {
     char name[FS_FNAME_MAX];
     file_t type;
 } file_record_t;
+typedef struct {
+    size_t free_blocks;
+    size_t free_inodes;
+    size_t largest_free_extent;  // most blocks a file could get in one contiguous run
+} fs_stat_t;
 ///
 /// Formats (and mounts) an F16FS file for use
 /// \param fname The file to format
@@ -29,6 +35,21 @@ F16FS_t *fs_format(const char *path);
 ///
 F16FS_t *fs_mount(const char *path);
 ///
+/// Formats (and mounts) an F16FS file for use, with the given block_store backend
+///  (BS_BACKEND_ASYNC keeps all of a large fs_read's blocks in flight at once)
+/// \param fname The file to format
+/// \param config The block_store backend options, NULL for the defaults
+/// \return Mounted F16FS object, NULL on error
+///
+F16FS_t *fs_format_config(const char *path, const block_store_config_t *config);
+///
+/// Mounts an F16FS object and prepares it for use, with the given block_store backend
+/// \param fname The file to mount
+/// \param config The block_store backend options, NULL for the defaults
+/// \return Mounted F16FS object, NULL on error
+///
+F16FS_t *fs_mount_config(const char *path, const block_store_config_t *config);
+///
 /// Unmounts the given object and frees all related resources
 /// \param fs The F16FS object to unmount
 /// \return 0 on success, < 0 on failure
@@ -112,6 +133,29 @@ int fs_remove(F16FS_t *fs, const char *path);
 ///
 dyn_array_t *fs_get_dir(F16FS_t *fs, const char *path);
 ///
+/// Writes everything changed on the file system out to the backing file
+///   Without this, changes reach the file whenever the kernel gets around to it
+/// \param fs The F16FS to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_sync(F16FS_t *fs);
+///
+/// Writes the changes made to a single file out to the backing file
+///   Covers the file's data, its inode, and block allocations. Nothing else is written
+/// \param fs The F16FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(F16FS_t *fs, int fd);
+///
+/// Reports how much room is left on the file system
+///   Free blocks comes from block_store's running count, so it's cheap enough to check before every write
+/// \param fs The F16FS to query
+/// \param stats Where to put the numbers
+/// \return 0 on success, < 0 on error
+///
+int fs_statfs(F16FS_t *fs, fs_stat_t *stats);
+///
 /// !!! Graduate Level/Undergrad Bonus !!!
 /// !!! Activate tests from the cmake !!!
 ///
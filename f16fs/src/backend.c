@@ -3,11 +3,13 @@
 #include <string.h>
 #include <time.h>
 
+// Inodes are read and written in place, no sense in copying the whole block for 64 bytes
 bool read_inode(const F16FS_t *fs, void *data, const inode_ptr_t inode_number) {
     if (fs && data) {
-        inode_t buffer[INODES_PER_BOCK];
-        if (block_store_read(fs->bs, INODE_TO_BLOCK(inode_number), buffer)) {
-            memcpy(data, &buffer[INODE_INNER_IDX(inode_number)], sizeof(inode_t));
+        const inode_t *inode_block = (const inode_t *) block_store_map_block(fs->bs, INODE_TO_BLOCK(inode_number));
+        if (inode_block) {
+            memcpy(data, &inode_block[INODE_INNER_IDX(inode_number)], sizeof(inode_t));
+            block_store_unmap_block(fs->bs, INODE_TO_BLOCK(inode_number), false);
             return true;
         }
     }
@@ -16,10 +18,11 @@ bool read_inode(const F16FS_t *fs, void *data, const inode_ptr_t inode_number) {
 
 bool write_inode(F16FS_t *fs, const void *data, const inode_ptr_t inode_number) {
     if (fs && data) {  // checking if the inode number is valid is a tautology :/
-        inode_t buffer[INODES_PER_BOCK];
-        if (block_store_read(fs->bs, INODE_TO_BLOCK(inode_number), buffer)) {
-            memcpy(&buffer[INODE_INNER_IDX(inode_number)], data, sizeof(inode_t));
-            return block_store_write(fs->bs, INODE_TO_BLOCK(inode_number), buffer);
+        inode_t *inode_block = (inode_t *) block_store_map_block_writable(fs->bs, INODE_TO_BLOCK(inode_number));
+        if (inode_block) {
+            memcpy(&inode_block[INODE_INNER_IDX(inode_number)], data, sizeof(inode_t));
+            block_store_unmap_block(fs->bs, INODE_TO_BLOCK(inode_number), true);
+            return true;
         }
     }
     return false;
@@ -42,8 +45,15 @@ bool full_write(F16FS_t *fs, const void *data, const block_ptr_t block) {
     return false;
 }
 
-F16FS_t *ready_file(const char *path, const bool format) {
+F16FS_t *ready_file(const char *path, const bool format, const block_store_config_t *config) {
     F16FS_t *fs = (F16FS_t *) malloc(sizeof(F16FS_t));
+    // Backend is the caller's pick, geometry isn't
+    block_store_config_t bs_config = {BS_BACKEND_MMAP, 0, false, BLOCK_SIZE, DATA_BLOCK_MAX, false, false, false, false};
+    if (config) {
+        bs_config             = *config;
+        bs_config.block_size  = BLOCK_SIZE;
+        bs_config.block_count = DATA_BLOCK_MAX;
+    }
     if (fs) {
         if (format) {
             // get inode table
@@ -51,14 +61,12 @@ F16FS_t *ready_file(const char *path, const bool format) {
             // That's it?
 
             // oh, also, ya know, make the back store object. oops.
-            fs->bs = block_store_create(path);
+            fs->bs = block_store_create_config(path, &bs_config);
             if (fs->bs) {
-                bool valid = true;
                 // + 1 to snag the root dir block because lazy
-                for (int i = INODE_BLOCK_OFFSET; i < (DATA_BLOCK_OFFSET + 1) && valid; ++i) {
-                    valid &= block_store_request(fs->bs, i);
-                }
-                // inode table is already blanked because back_store blanks all data (woo)
+                bool valid =
+                    block_store_request_range(fs->bs, INODE_BLOCK_OFFSET, DATA_BLOCK_OFFSET + 1 - INODE_BLOCK_OFFSET);
+                // inode table is already blank because a new back_store reads as all zeroes (woo)
                 if (valid) {
                     // I'm actually not sure how to do this
                     // It's going to look like a mess
@@ -78,10 +86,17 @@ F16FS_t *ready_file(const char *path, const bool format) {
                 }
             }
         } else {
-            fs->bs = block_store_open(path);
-            // ... that's it?
+            fs->bs = block_store_open_config(path, &bs_config);
+            // Not one of ours if the blocks aren't what everything here is sized for
+            if (fs->bs && (block_store_get_block_size(fs->bs) != BLOCK_SIZE
+                           || block_store_get_block_count(fs->bs) != DATA_BLOCK_MAX)) {
+                block_store_close(fs->bs);
+                fs->bs = NULL;
+            }
         }
         if (fs->bs) {
+            // Every lookup goes through the inode table, get it loaded up front
+            block_store_advise(fs->bs, INODE_BLOCK_OFFSET, INODE_BLOCK_TOTAL, BS_ADVICE_WILLNEED);
             fs->fd_table.fd_status = bitmap_create(DESCRIPTOR_MAX);
             // Eh, won't bother blanking out tables, since that's the point of the bitmap
             if (fs->fd_table.fd_status) {
@@ -186,12 +201,12 @@ void scan_directory(const F16FS_t *const fs, const char *fname, const inode_ptr_
         if (fs && fname) {
             // inode number is always valid - tbh, that may mask errors and could be considered bad
             inode_t dir_inode;
-            dir_block_t dir_data;
+            const dir_block_t *dir_data;
             if (read_inode(fs, &dir_inode, inode) && INODE_IS_TYPE(&dir_inode, FS_DIRECTORY)
-                && full_read(fs, &dir_data, dir_inode.data_ptrs[0])) {
+                && (dir_data = (const dir_block_t *) block_store_map_block(fs->bs, dir_inode.data_ptrs[0]))) {
                 res->success = true;
                 res->block   = dir_inode.data_ptrs[0];
-                res->total   = dir_data.mdata.size;
+                res->total   = dir_data->mdata.size;
                 res->parent  = inode;
                 // let's validate the fname
                 const size_t fname_len = strnlen(fname, FS_FNAME_MAX);
@@ -200,15 +215,16 @@ void scan_directory(const F16FS_t *const fs, const char *fname, const inode_ptr_
                     // fname is vaguely validated
                     res->valid = true;
                     for (unsigned i = 0; i < DIR_REC_MAX; ++i) {
-                        if (strncmp(fname, dir_data.entries[i].fname, FS_FNAME_MAX) == 0) {
+                        if (strncmp(fname, dir_data->entries[i].fname, FS_FNAME_MAX) == 0) {
                             // found it!
                             res->found = true;
-                            res->inode = dir_data.entries[i].inode;
+                            res->inode = dir_data->entries[i].inode;
                             res->pos   = i;
-                            return;
+                            break;
                         }
                     }
                 }
+                block_store_unmap_block(fs->bs, res->block, false);
             }
         }
     }
@@ -217,16 +233,18 @@ void scan_directory(const F16FS_t *const fs, const char *fname, const inode_ptr_
 // Just what it sounds like. 0 on error
 inode_ptr_t find_free_inode(const F16FS_t *const fs) {
     if (fs) {
-        inode_t inode_block[INODES_PER_BOCK];
         inode_ptr_t free_inode = 0;
         for (unsigned blk = INODE_BLOCK_OFFSET; blk < DATA_BLOCK_OFFSET; ++blk) {
-            if (full_read(fs, &inode_block, blk)) {
+            const inode_t *inode_block = (const inode_t *) block_store_map_block(fs->bs, blk);
+            if (inode_block) {
                 for (unsigned i = 0; i < INODES_PER_BOCK; ++i, ++free_inode) {
                     if (! inode_block[i].mdata.in_use) {
+                        block_store_unmap_block(fs->bs, blk, false);
                         return free_inode;
                         // potentially a conversion warning because integer truncation/depromotion
                     }
                 }
+                block_store_unmap_block(fs->bs, blk, false);
             } else {
                 return 0;  // :/
             }
@@ -235,6 +253,60 @@ inode_ptr_t find_free_inode(const F16FS_t *const fs) {
     return 0;
 }
 
+// Blocks get_block_ptrs hands out to a file as it grows
+// Pulled from block_store in extents so sequential files land in adjacent blocks
+typedef struct {
+    unsigned ids[EXTENT_POOL_MAX];
+    size_t next, count;
+    unsigned hint;  // Block the first extent should be placed near, 0 for wherever
+} block_pool_t;
+
+// Next new block from the pool, refilling it with up to wanted blocks if it's empty. 0 on error
+static block_ptr_t pool_take(F16FS_t *fs, block_pool_t *pool, size_t wanted) {
+    if (pool->next == pool->count) {
+        wanted      = wanted > EXTENT_POOL_MAX ? EXTENT_POOL_MAX : (wanted ? wanted : 1);
+        pool->next  = 0;
+        pool->count = 0;
+        if (pool->hint) {
+            // Put the first one next to what the file already has, the rest follow it
+            if (!(pool->ids[0] = block_store_allocate_near(fs->bs, pool->hint))) {
+                return 0;
+            }
+            pool->hint  = 0;
+            pool->count = 1 + block_store_allocate_extent(fs->bs, wanted - 1, pool->ids + 1);
+        } else {
+            pool->count = block_store_allocate_extent(fs->bs, wanted, pool->ids);
+        }
+        if (!pool->count) {
+            return 0;
+        }
+    }
+    return pool->ids[pool->next++];
+}
+
+// Maps an indirect block for in-place updates
+// allocating (and blanking, since released blocks keep their data) it first if the file doesn't have it yet
+static block_ptr_t *map_indirect(F16FS_t *fs, block_pool_t *pool, block_ptr_t *block, size_t wanted) {
+    if (!*block) {
+        if (!(*block = pool_take(fs, pool, wanted))) {
+            return NULL;
+        }
+        block_ptr_t *indirect = (block_ptr_t *) block_store_map_block_writable(fs->bs, *block);
+        if (indirect) {
+            memset(indirect, 0x00, BLOCK_SIZE);
+        }
+        return indirect;
+    }
+    return (block_ptr_t *) block_store_map_block_writable(fs->bs, *block);
+}
+
+// Returns whatever the pool didn't end up using
+static void pool_drain(F16FS_t *fs, block_pool_t *pool) {
+    for (; pool->next < pool->count; ++pool->next) {
+        block_store_release(fs->bs, pool->ids[pool->next]);
+    }
+}
+
 // Fills array with data blocks
 void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, size_t pos, size_t num_of_blocks) {
   if (fs == NULL || file_inode == NULL || block_ptrs == NULL || num_of_blocks == 0) {
@@ -248,6 +320,12 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
     
     bool progress = true;
 
+    // + 1 leaves room for an indirect block along the way
+    block_pool_t pool = {{0}, 0, 0, 0};
+    if (block_index && block_index <= DIRECT_TOTAL && file_inode->data_ptrs[block_index - 1]) {
+      pool.hint = file_inode->data_ptrs[block_index - 1] + 1;
+    }
+
     //get direct block ptrs
     while (fbi < DIRECT_TOTAL && bpi < num_of_blocks) {
       if (!progress) {
@@ -255,7 +333,7 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
       }
       if (!file_inode->data_ptrs[fbi]) {//not currently a block at this ind
       
-        file_inode->data_ptrs[fbi] = block_store_allocate(fs->bs);
+        file_inode->data_ptrs[fbi] = pool_take(fs, &pool, num_of_blocks - bpi + 1);
         
         if (!file_inode->data_ptrs[fbi]) {
           progress = false;
@@ -271,19 +349,10 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
     //get indirect block ptrs
     if (fbi < (DIRECT_TOTAL + INDIRECT_TOTAL) && bpi < num_of_blocks) {
       if (progress) {
-        block_ptr_t indirect_block[INDIRECT_TOTAL] = {0};
-          if (!(file_inode->data_ptrs[6])) {//need new indirect block
-        
-            file_inode->data_ptrs[6] = block_store_allocate(fs->bs);
-          
-            if (!(file_inode->data_ptrs[6])) {
-              progress = false;
-            }
-          } 
-          else {
-            if (!full_read(fs, indirect_block, file_inode->data_ptrs[6])) {//get curr indirect block
-              progress = false;
-            }
+          //get curr indirect block, or a new one
+          block_ptr_t *indirect_block = map_indirect(fs, &pool, &file_inode->data_ptrs[6], num_of_blocks - bpi + 1);
+          if (!indirect_block) {
+            progress = false;
           }
           if (progress) {//get all other blocks from indirect block
             for (size_t i = (fbi-DIRECT_TOTAL) % INDIRECT_TOTAL; i < INDIRECT_TOTAL && bpi < num_of_blocks; i++) {
@@ -291,7 +360,7 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
                 break;
               }
               if (!indirect_block[i]) {
-                indirect_block[i] = block_store_allocate(fs->bs);
+                indirect_block[i] = pool_take(fs, &pool, num_of_blocks - bpi + 1);
                 if (!indirect_block[i]) {
                   progress = false;
                 }
@@ -302,9 +371,7 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
                 fbi++;
               }
             }
-            if (!full_write(fs, indirect_block, file_inode->data_ptrs[6])) {
-              progress = false;
-            }
+            block_store_unmap_block(fs->bs, file_inode->data_ptrs[6], true);
           }
         }
       }
@@ -312,36 +379,20 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
     //get double indirect block ptrs 
     if (bpi < num_of_blocks) {
       if (progress) {
-        block_ptr_t db_ind_block[INDIRECT_TOTAL] = {0};
-        if (!(file_inode->data_ptrs[7])) {
-          file_inode->data_ptrs[7] = block_store_allocate(fs->bs);
-          if (!(file_inode->data_ptrs[7])) {
-            progress = false;
-          }
-        } 
-        else {
-          if(!full_read(fs, db_ind_block, file_inode->data_ptrs[7])) {
-            progress = false;
-          }
+        block_ptr_t *db_ind_block = map_indirect(fs, &pool, &file_inode->data_ptrs[7], num_of_blocks - bpi + 1);
+        if (!db_ind_block) {
+          progress = false;
         }
         if (progress) {
           for (size_t j = (fbi-(DIRECT_TOTAL + INDIRECT_TOTAL)) / INDIRECT_TOTAL; bpi < num_of_blocks && progress && j < INDIRECT_TOTAL; j++) {
-            block_ptr_t indirect_block[INDIRECT_TOTAL] = {0};
-            if (!db_ind_block[j]) {
-              db_ind_block[j] = block_store_allocate(fs->bs);
-              if (!db_ind_block[j]) {
-                progress = false;
-              }
-            } 
-            else {
-              if (!full_read(fs, indirect_block, db_ind_block[j])) {
-                progress = false;
-              }
+            block_ptr_t *indirect_block = map_indirect(fs, &pool, &db_ind_block[j], num_of_blocks - bpi + 1);
+            if (!indirect_block) {
+              progress = false;
             }
             if (progress) {
               for (size_t k = (fbi-(DIRECT_TOTAL + INDIRECT_TOTAL)) % INDIRECT_TOTAL; bpi < num_of_blocks && progress && k < INDIRECT_TOTAL; k++) {
                 if (!indirect_block[k]) {
-                  indirect_block[k] = block_store_allocate(fs->bs);
+                  indirect_block[k] = pool_take(fs, &pool, num_of_blocks - bpi + 1);
                   if(!indirect_block[k]) {
                     progress = false;
                   }
@@ -352,17 +403,102 @@ void get_block_ptrs(F16FS_t *fs, inode_t *file_inode, block_ptr_t *block_ptrs, s
                   fbi++;
                 }
               }
-              if (!full_write(fs, indirect_block, db_ind_block[j])) {
-                progress = false;
-              }
+              block_store_unmap_block(fs->bs, db_ind_block[j], true);
             }
           }
-        }
-        if (!full_write(fs, db_ind_block, file_inode->data_ptrs[7])) {
-            progress = false;
+          block_store_unmap_block(fs->bs, file_inode->data_ptrs[7], true);
         }
       }
     }
+    pool_drain(fs, &pool);
   }
   return;
-}
\ No newline at end of file
+}
+
+// Big reads get the blocks requested ahead of time, a run of adjacent blocks at a time
+void advise_stream(F16FS_t *fs, const unsigned *block_ids, size_t count) {
+    if (fs && block_ids && count >= STREAM_ADVISE_MIN) {
+        for (size_t i = 0; i < count;) {
+            size_t run = 1;
+            while (i + run < count && block_ids[i + run] == block_ids[i] + run) {
+                ++run;
+            }
+            block_store_advise(fs->bs, block_ids[i], run, BS_ADVICE_WILLNEED);
+            i += run;
+        }
+    }
+}
+
+// Collects block ids into runs of adjacent blocks so each run is written back with one call
+// Runs are only written back, not synced, so the caller syncs once when it's done with all of them
+typedef struct {
+    unsigned first, count;
+    bool success;
+} flush_run_t;
+
+static void flush_add(F16FS_t *fs, flush_run_t *run, const unsigned block) {
+    if (run->count && block == run->first + run->count) {
+        ++run->count;
+        return;
+    }
+    if (run->count) {
+        run->success &= block_store_flush_range(fs->bs, run->first, run->count, true);
+    }
+    run->first = block;
+    run->count = 1;
+}
+
+// Writes back every block the file owns, data and indirect blocks alike. Nothing's synced, that's block_store_sync
+// Walks the pointers directly instead of using get_block_ptrs, since that would allocate for holes
+bool flush_file(F16FS_t *fs, const inode_t *file_inode) {
+    if (fs && file_inode) {
+        flush_run_t run = {0, 0, true};
+        for (unsigned i = 0; i < DIRECT_TOTAL; ++i) {
+            if (file_inode->data_ptrs[i]) {
+                flush_add(fs, &run, file_inode->data_ptrs[i]);
+            }
+        }
+        if (file_inode->data_ptrs[6]) {
+            flush_add(fs, &run, file_inode->data_ptrs[6]);
+            const block_ptr_t *indirect = (const block_ptr_t *) block_store_map_block(fs->bs, file_inode->data_ptrs[6]);
+            if (!indirect) {
+                return false;
+            }
+            for (unsigned i = 0; i < INDIRECT_TOTAL; ++i) {
+                if (indirect[i]) {
+                    flush_add(fs, &run, indirect[i]);
+                }
+            }
+            block_store_unmap_block(fs->bs, file_inode->data_ptrs[6], false);
+        }
+        if (file_inode->data_ptrs[7]) {
+            flush_add(fs, &run, file_inode->data_ptrs[7]);
+            const block_ptr_t *dbl_indirect = (const block_ptr_t *) block_store_map_block(fs->bs, file_inode->data_ptrs[7]);
+            if (!dbl_indirect) {
+                return false;
+            }
+            for (unsigned j = 0; j < INDIRECT_TOTAL && run.success; ++j) {
+                if (dbl_indirect[j]) {
+                    flush_add(fs, &run, dbl_indirect[j]);
+                    const block_ptr_t *indirect = (const block_ptr_t *) block_store_map_block(fs->bs, dbl_indirect[j]);
+                    if (!indirect) {
+                        run.success = false;
+                        break;
+                    }
+                    for (unsigned k = 0; k < INDIRECT_TOTAL; ++k) {
+                        if (indirect[k]) {
+                            flush_add(fs, &run, indirect[k]);
+                        }
+                    }
+                    block_store_unmap_block(fs->bs, dbl_indirect[j], false);
+                }
+            }
+            block_store_unmap_block(fs->bs, file_inode->data_ptrs[7], false);
+        }
+        if (run.count) {
+            run.success &= block_store_flush_range(fs->bs, run.first, run.count, true);
+        }
+        return run.success;
+    }
+    return false;
+}
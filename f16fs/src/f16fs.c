@@ -14,7 +14,16 @@
 /// \return Mounted S16FS object, NULL on error
 ///
 F16FS_t *fs_format(const char *path) {
-    return ready_file(path, true);
+    return ready_file(path, true, NULL);
+}
+///
+/// Formats (and mounts) an F16FS file for use, with the given block_store backend
+/// \param fname The file to format
+/// \param config The block_store backend options, NULL for the defaults
+/// \return Mounted F16FS object, NULL on error
+///
+F16FS_t *fs_format_config(const char *path, const block_store_config_t *config) {
+    return ready_file(path, true, config);
 }
 ///
 /// Mounts an F16FS object and prepares it for use
@@ -22,7 +31,16 @@ F16FS_t *fs_format(const char *path) {
 /// \return Mounted F16FS object, NULL on error
 ///
 F16FS_t *fs_mount(const char *path) {
-    return ready_file(path, false);
+    return ready_file(path, false, NULL);
+}
+///
+/// Mounts an F16FS object and prepares it for use, with the given block_store backend
+/// \param fname The file to mount
+/// \param config The block_store backend options, NULL for the defaults
+/// \return Mounted F16FS object, NULL on error
+///
+F16FS_t *fs_mount_config(const char *path, const block_store_config_t *config) {
+    return ready_file(path, false, config);
 }
 ///
 /// Unmounts the given object and frees all related resources
@@ -94,7 +112,7 @@ int fs_create(F16FS_t *fs, const char *path, file_t type) {
                                 // (added block to locate_file if file is a dir. Handy.)
                                 dir_block_t parent_dir;
                                 inode_t new_inode;
-                                dir_block_t new_dir;
+                                dir_block_t *new_dir;
                                 uint32_t now = time(NULL);
                                 // load dir, check it has space.
                                 if (full_read(fs, &parent_dir, file_status.block)
@@ -137,9 +155,13 @@ int fs_create(F16FS_t *fs, const char *path, file_t type) {
                                                     new_inode = (inode_t){
                                                         {0, 0777, now, now, now, file_status.inode, FS_DIRECTORY, 1, {0}},
                                                         {new_dir_ptr, 0, 0, 0, 0, 0}};
-                                                    memset(&new_dir, 0x00, sizeof(dir_block_t));
-                                                    if (!(success = full_write(fs, &new_dir, new_dir_ptr)
-                                                                    && write_inode(fs, &new_inode, new_inode_idx))) {
+                                                    // blank it in place
+                                                    if ((new_dir = (dir_block_t *) block_store_map_block_writable(
+                                                             fs->bs, new_dir_ptr))) {
+                                                        memset(new_dir, 0x00, sizeof(dir_block_t));
+                                                        block_store_unmap_block(fs->bs, new_dir_ptr, true);
+                                                    }
+                                                    if (!(success = new_dir && write_inode(fs, &new_inode, new_inode_idx))) {
                                                         // transation: if it didn't work, release the allocated block
                                                         block_store_release(fs->bs, new_dir_ptr);
                                                     }
@@ -264,32 +286,35 @@ dyn_array_t *fs_get_dir(F16FS_t *fs, const char *path) {
         result_t search_results;
         locate_file(fs, path, &search_results);
         if (search_results.success && search_results.found && search_results.type == FS_DIRECTORY) {
-            dir_block_t dir;
-            if (full_read(fs, &dir, search_results.block)) {
+            const dir_block_t *dir = (const dir_block_t *) block_store_map_block(fs->bs, search_results.block);
+            if (dir) {
                 dyn_array_t *dir_contents = dyn_array_create(16, sizeof(file_record_t), NULL);
                 if (dir_contents) {
                     inode_t file_inode;
                     file_record_t record;
                     for (int i = 0; i < DIR_REC_MAX; ++i) {
-                        if (dir.entries[i].fname[0] != '\0') {
+                        if (dir->entries[i].fname[0] != '\0') {
                             // Oh man, this is actually a pain. All the inodes have to be loaded. Uggghhhhh
-                            if (read_inode(fs, &file_inode, dir.entries[i].inode)) {
+                            if (read_inode(fs, &file_inode, dir->entries[i].inode)) {
                                 record.type = (file_t) file_inode.mdata.type;
-                                strncpy(record.name, dir.entries[i].fname, FS_FNAME_MAX);
+                                strncpy(record.name, dir->entries[i].fname, FS_FNAME_MAX);
                                 if (!dyn_array_push_back(dir_contents, &record)) {
                                     // also broke
                                     dyn_array_destroy(dir_contents);
-                                    return NULL;
+                                    dir_contents = NULL;
+                                    break;
                                 }
                             } else {
                                 // welp, SOMETHING broke.
                                 dyn_array_destroy(dir_contents);
-                                return NULL;
+                                dir_contents = NULL;
+                                break;
                             }
                         }
                     }
-                    return dir_contents;
                 }
+                block_store_unmap_block(fs->bs, search_results.block, false);
+                return dir_contents;
             }
         }
     }
@@ -377,31 +402,16 @@ ssize_t fs_write(F16FS_t *fs, int fd, const void *src, size_t nbyte) {
     }
     else {
       size_t pos_in_file = fs->fd_table.fd_pos[fd]; //pos to begin writing in file
-      /*if (pos_in_file % BLOCK_SIZE == 0) {
-        pos_in_file = 0;
-      }*/
-      pos_in_file = (pos_in_file % BLOCK_SIZE);
-            
-      size_t block_offset = POSITION_TO_INNER_OFFSET(pos_in_file);      
-      size_t block_bytes_left = (BLOCK_SIZE - block_offset);
-      size_t full_blocks;
-      size_t extra_block_bytes;
-
-      if (nbyte > block_bytes_left) {//must do some partial writing to the file
-        full_blocks = (nbyte - block_bytes_left) / BLOCK_SIZE;
-        extra_block_bytes = (nbyte - block_bytes_left) % BLOCK_SIZE;
-      } 
-      else {//we can write fully
-        block_bytes_left = nbyte;
-        full_blocks = 0;
-        extra_block_bytes = 0;
+      if (pos_in_file >= FILE_SIZE_MAX) {
+        return 0;//file is as big as it gets
       }
-
-      size_t num_blocks_needed = 1 + full_blocks;
-      if (extra_block_bytes) {
-        num_blocks_needed++;//find num of blocks needed for writing
+      if (pos_in_file + nbyte > FILE_SIZE_MAX) {
+        nbyte = FILE_SIZE_MAX - pos_in_file;//file can't grow any more than this
       }
 
+      size_t block_offset = POSITION_TO_INNER_OFFSET(pos_in_file);
+      size_t num_blocks_needed = (block_offset + nbyte + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
       block_ptr_t needed_block_ptrs[num_blocks_needed];
       for (size_t i = 0; i < num_blocks_needed; i++) {
         needed_block_ptrs[i] = 0;
@@ -409,53 +419,56 @@ ssize_t fs_write(F16FS_t *fs, int fd, const void *src, size_t nbyte) {
             
       get_block_ptrs(fs, &file_inode, needed_block_ptrs, pos_in_file, num_blocks_needed);
 
+      size_t blocks_got = 0;//less than needed if we ran out of space
+      while (blocks_got < num_blocks_needed && needed_block_ptrs[blocks_got]) {
+        blocks_got++;
+      }
+
       ssize_t num_written = 0;
+      size_t i = 0;
+      bool progress = true;
 
-      //go throught needed blocks, getting data from src
-      for (size_t i = 0; i < num_blocks_needed; i++) {
-        if (!needed_block_ptrs[i]) {
-          break;
+      //partial first block is updated in place
+      if (i < blocks_got && (block_offset || nbyte < BLOCK_SIZE)) {
+        size_t block_bytes = BLOCK_SIZE - block_offset;
+        if (block_bytes > nbyte) {
+          block_bytes = nbyte;
+        }
+        void *block = block_store_map_block_writable(fs->bs, needed_block_ptrs[i]);
+        if (block) {
+          memcpy(INCREMENT_VOID(block, block_offset), src, block_bytes);
+          block_store_unmap_block(fs->bs, needed_block_ptrs[i], true);
+          num_written = num_written + block_bytes;
+          i++;
         }
-        else if (i == 0) {
-          //dont do full write -> i need to write func for these
-          data_block_t temp_block;
-          if (block_store_read(fs->bs, needed_block_ptrs[i], &temp_block)) {
-            memcpy(INCREMENT_VOID(&temp_block, block_offset), INCREMENT_VOID(src, 0), block_bytes_left);
-            if (!block_store_write(fs->bs, needed_block_ptrs[i], &temp_block)) {
-              //return -3;
-              break;
-            }
-            else {
-              num_written = num_written + block_bytes_left;
-            }
-          }
-          else {
-            break;
-          }
-        } 
-        else if (i == (num_blocks_needed - 1) && extra_block_bytes) {
-          data_block_t temp_block;
-          if (block_store_read(fs->bs, needed_block_ptrs[i], &temp_block)) {
-            memcpy(INCREMENT_VOID(&temp_block, 0), INCREMENT_VOID(src, num_written), extra_block_bytes);
-            if (!block_store_write(fs->bs, needed_block_ptrs[i], &temp_block)) {
-              //return -3;
-              break;
-            }
-            else {
-              num_written = num_written + extra_block_bytes;
-            }
-          }
-          else {
-            break;
-          }
-        } 
         else {
-          if (full_write(fs, INCREMENT_VOID(src, num_written), needed_block_ptrs[i])){
-            num_written = num_written + BLOCK_SIZE;
-          }
-          else {
-            break;
-          }
+          progress = false;
+        }
+      }
+
+      //all the full blocks go in one vectored write
+      size_t full_blocks = (nbyte - num_written) / BLOCK_SIZE;
+      if (full_blocks > blocks_got - i) {
+        full_blocks = blocks_got - i;
+      }
+      if (progress && full_blocks) {
+        unsigned block_ids[full_blocks];
+        for (size_t j = 0; j < full_blocks; j++) {
+          block_ids[j] = needed_block_ptrs[i + j];
+        }
+        size_t blocks_written = block_store_writev(fs->bs, block_ids, full_blocks, INCREMENT_VOID(src, num_written));
+        num_written = num_written + blocks_written * BLOCK_SIZE;
+        i = i + blocks_written;
+        progress = (blocks_written == full_blocks);
+      }
+
+      //and whatever is left over goes at the start of the last block
+      if (progress && i < blocks_got && (size_t) num_written < nbyte) {
+        void *block = block_store_map_block_writable(fs->bs, needed_block_ptrs[i]);
+        if (block) {
+          memcpy(block, INCREMENT_VOID(src, num_written), nbyte - num_written);
+          block_store_unmap_block(fs->bs, needed_block_ptrs[i], true);
+          num_written = nbyte;
         }
       }
 
@@ -499,36 +512,18 @@ ssize_t fs_read(F16FS_t *fs, int fd, void *dst, size_t nbyte) {
       return -2;
     }
     else {
-      size_t pos_in_file = fs->fd_table.fd_pos[fd]; //pos to begin writing in file
-      /*if (pos_in_file % BLOCK_SIZE == 0) {
-        pos_in_file = 0;
-      }*/
-      pos_in_file = (pos_in_file % BLOCK_SIZE);
+      size_t pos_in_file = fs->fd_table.fd_pos[fd]; //pos to begin reading in file
 
-      size_t block_offset = POSITION_TO_INNER_OFFSET(pos_in_file);
-      size_t block_bytes_left = BLOCK_SIZE - block_offset;
-      size_t full_blocks;
-      size_t extra_block_bytes;
-      
       size_t byte_total = nbyte;
+      if (pos_in_file >= file_inode.mdata.size) {
+        return 0;//nothing left to read
+      }
       if (pos_in_file + nbyte > file_inode.mdata.size) {
         byte_total = (file_inode.mdata.size - pos_in_file);//restrict byte total
       }
 
-      if (byte_total > block_bytes_left) {//must do some partial reading in the file
-        full_blocks = (byte_total - block_bytes_left) / BLOCK_SIZE;
-        extra_block_bytes = (byte_total - block_bytes_left) % BLOCK_SIZE;
-      } 
-      else {//we can read fully
-        block_bytes_left = byte_total;
-        full_blocks = 0;
-        extra_block_bytes = 0;
-      }
-
-      size_t blocks_to_read = (1 + full_blocks);
-      if (extra_block_bytes) {
-        blocks_to_read++;//find num of blocks to read
-      }
+      size_t block_offset = POSITION_TO_INNER_OFFSET(pos_in_file);
+      size_t blocks_to_read = (block_offset + byte_total + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
       block_ptr_t needed_block_ptrs[blocks_to_read];
       for (size_t i = 0; i < blocks_to_read; i++) {
@@ -537,41 +532,57 @@ ssize_t fs_read(F16FS_t *fs, int fd, void *dst, size_t nbyte) {
             
       get_block_ptrs(fs, &file_inode, needed_block_ptrs, pos_in_file, blocks_to_read);
 
+      size_t blocks_got = 0;
+      while (blocks_got < blocks_to_read && needed_block_ptrs[blocks_got]) {
+        blocks_got++;
+      }
+
       ssize_t bytes_read = 0;
+      size_t i = 0;
+      bool progress = true;
 
-      //loop through all the blocks and copy data to the buffer
-      for (size_t i = 0; i < blocks_to_read; i++) {
-        if (!needed_block_ptrs[i]) {
-          break;
+      //partial first block straight out of the block store
+      if (i < blocks_got && (block_offset || byte_total < BLOCK_SIZE)) {
+        size_t block_bytes = BLOCK_SIZE - block_offset;
+        if (block_bytes > byte_total) {
+          block_bytes = byte_total;
+        }
+        const void *block = block_store_map_block(fs->bs, needed_block_ptrs[i]);
+        if (block) {
+          memcpy(dst, INCREMENT_VOID(block, block_offset), block_bytes);
+          block_store_unmap_block(fs->bs, needed_block_ptrs[i], false);
+          bytes_read = bytes_read + block_bytes;
+          i++;
         }
         else {
-          data_block_t temp_block;
-          if (block_store_read(fs->bs, needed_block_ptrs[i], &temp_block)) {
-            memcpy(INCREMENT_VOID(dst, 0), INCREMENT_VOID(&temp_block, block_offset), block_bytes_left);
-            bytes_read = bytes_read + block_bytes_left;
-          }
-          else {
-            break;
-          }
-        } 
-        if (i == (blocks_to_read - 1) && extra_block_bytes) {
-          data_block_t temp_block;
-          if (block_store_read(fs->bs, needed_block_ptrs[i], &temp_block)) {
-            memcpy(INCREMENT_VOID(dst, bytes_read), INCREMENT_VOID(&temp_block, block_offset), block_bytes_left);
-            bytes_read = bytes_read + block_bytes_left;
-          }
-          else {
-            break;
-          }
-        } 
-        else {
-          if (full_read(fs, INCREMENT_VOID(dst, bytes_read), needed_block_ptrs[i])) {
-            bytes_read = bytes_read + BLOCK_SIZE;
-          }
-          else {
-            break;
-          }
-          bytes_read = bytes_read + BLOCK_SIZE;
+          progress = false;
+        }
+      }
+
+      //all the full blocks in one vectored read
+      size_t full_blocks = (byte_total - bytes_read) / BLOCK_SIZE;
+      if (full_blocks > blocks_got - i) {
+        full_blocks = blocks_got - i;
+      }
+      if (progress && full_blocks) {
+        unsigned block_ids[full_blocks];
+        for (size_t j = 0; j < full_blocks; j++) {
+          block_ids[j] = needed_block_ptrs[i + j];
+        }
+        advise_stream(fs, block_ids, full_blocks);
+        size_t blocks_read = block_store_readv(fs->bs, block_ids, full_blocks, INCREMENT_VOID(dst, bytes_read));
+        bytes_read = bytes_read + blocks_read * BLOCK_SIZE;
+        i = i + blocks_read;
+        progress = (blocks_read == full_blocks);
+      }
+
+      //then the start of the last block
+      if (progress && i < blocks_got && (size_t) bytes_read < byte_total) {
+        const void *block = block_store_map_block(fs->bs, needed_block_ptrs[i]);
+        if (block) {
+          memcpy(INCREMENT_VOID(dst, bytes_read), block, byte_total - bytes_read);
+          block_store_unmap_block(fs->bs, needed_block_ptrs[i], false);
+          bytes_read = byte_total;
         }
       }
       
@@ -583,6 +594,68 @@ ssize_t fs_read(F16FS_t *fs, int fd, void *dst, size_t nbyte) {
   return -1;
 }
 
+///
+/// Writes everything changed on the file system out to the backing file
+///   Without this, changes reach the file whenever the kernel gets around to it
+/// \param fs The F16FS to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_sync(F16FS_t *fs) {
+    if (fs && block_store_flush(fs->bs, false)) {
+        return 0;
+    }
+    return -1;
+}
+
+///
+/// Writes the changes made to a single file out to the backing file
+///   Covers the file's data, its inode, and block allocations. Nothing else is written
+/// \param fs The F16FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(F16FS_t *fs, int fd) {
+    if (fs && fd >= 0 && fd < DESCRIPTOR_MAX && bitmap_test(fs->fd_table.fd_status, fd)) {
+        inode_t file_inode;
+        const inode_ptr_t file_inode_ptr = fs->fd_table.fd_inode[fd];
+        // FBM is everything in front of the inode table
+        // It all gets written back first, then one sync covers the lot
+        if (read_inode(fs, &file_inode, file_inode_ptr) && flush_file(fs, &file_inode)
+            && block_store_flush_range(fs->bs, INODE_TO_BLOCK(file_inode_ptr), 1, true)
+            && block_store_flush_range(fs->bs, 0, INODE_BLOCK_OFFSET, true) && block_store_sync(fs->bs)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+///
+/// Reports how much room is left on the file system
+///   Free blocks comes from block_store's running count, so it's cheap enough to check before every write
+/// \param fs The F16FS to query
+/// \param stats Where to put the numbers
+/// \return 0 on success, < 0 on error
+///
+int fs_statfs(F16FS_t *fs, fs_stat_t *stats) {
+    if (fs && stats) {
+        stats->free_blocks         = block_store_free_count(fs->bs);
+        stats->largest_free_extent = block_store_largest_free_extent(fs->bs);
+        stats->free_inodes         = 0;
+        for (unsigned blk = INODE_BLOCK_OFFSET; blk < DATA_BLOCK_OFFSET; ++blk) {
+            const inode_t *inode_block = (const inode_t *) block_store_map_block(fs->bs, blk);
+            if (!inode_block) {
+                return -1;
+            }
+            for (unsigned i = 0; i < INODES_PER_BOCK; ++i) {
+                stats->free_inodes += !inode_block[i].mdata.in_use;
+            }
+            block_store_unmap_block(fs->bs, blk, false);
+        }
+        return 0;
+    }
+    return -1;
+}
+
 ///
 /// Deletes the specified file
 ///   Directories can only be removed when empty
@@ -608,7 +681,7 @@ int fs_remove(F16FS_t *fs, const char *path) {
       if (read_inode(fs, &file_inode, file_status.inode)
       && read_inode(fs, &file_parent_inode, file_status.parent)) {
                
-        dir_block_t curr_dir;
+        const dir_block_t *curr_dir;
         size_t file_blocks;
                 
         if (file_status.type == FS_REGULAR) {
@@ -617,43 +690,61 @@ int fs_remove(F16FS_t *fs, const char *path) {
           if (file_inode.mdata.size % BLOCK_SIZE != 0) {
             file_blocks++;
           }
-          for (size_t i = 0; i < DESCRIPTOR_MAX; i++) { 
-            if (bitmap_test(fs->fd_table.fd_status, i)) {
-              if (fs->fd_table.fd_inode[i] == file_status.inode) {
-                fs_close(fs, i);//it is in fd table so get rid of it
-              }
+          // only the open descriptors
+          for (size_t i = bitmap_next_set(fs->fd_table.fd_status, 0); i != SIZE_MAX;
+               i = bitmap_next_set(fs->fd_table.fd_status, i + 1)) {
+            if (fs->fd_table.fd_inode[i] == file_status.inode) {
+              fs_close(fs, i);//it is in fd table so get rid of it
             }
           }
         }
         else if (file_status.type == FS_DIRECTORY) {
           file_blocks = 1;
-          if (!full_read(fs, &curr_dir, file_status.block)) {
+          if (!(curr_dir = (const dir_block_t *) block_store_map_block(fs->bs, file_status.block))) {
             return -1;//dir not empty
           } 
-          if (curr_dir.mdata.size != 0) {
+          const bool dir_empty = (curr_dir->mdata.size == 0);
+          block_store_unmap_block(fs->bs, file_status.block, false);
+          if (!dir_empty) {
             return -1;//dir not empty
           }
         }
                 
         if (file_blocks) {
-          block_ptr_t block_ptrs[file_blocks];
+          // a size bigger than any file can be means the inode is junk, don't size anything off it
+          if (file_blocks > FILE_SIZE_MAX / BLOCK_SIZE) {
+            return -1;
+          }
+
+          // everything gets gathered up and released in one go, so block_store can free runs at a time
+          // (a full size file has a few hundred KB of ids, so they go on the heap)
+          block_ptr_t *block_ptrs = (block_ptr_t *) malloc(file_blocks * sizeof(block_ptr_t));
+          unsigned *release_ids = (unsigned *) malloc((file_blocks + 1 + INDIRECT_TOTAL) * sizeof(unsigned));
+          size_t release_count = 0;
+          if (!block_ptrs || !release_ids) {
+            free(block_ptrs);
+            free(release_ids);
+            return -1;
+          }
                     
           get_block_ptrs(fs, &file_inode, block_ptrs, 0, file_blocks);
                     
           for (size_t i = 0; i < file_blocks; i++) {
             if (block_ptrs[i]) {
-              block_store_release(fs->bs, block_ptrs[i]);//realease direct blocks
+              release_ids[release_count++] = block_ptrs[i];//realease direct blocks
             }
           }
 
           if (file_inode.data_ptrs[6]) {
-            block_store_release(fs->bs, file_inode.data_ptrs[6]);//release indirect blocks
+            release_ids[release_count++] = file_inode.data_ptrs[6];//release indirect blocks
           }
                     
           if (file_inode.data_ptrs[7]) {
-            block_ptr_t indirect_block[INDIRECT_TOTAL];
+            const block_ptr_t *indirect_block = (const block_ptr_t *) block_store_map_block(fs->bs, file_inode.data_ptrs[7]);
                         
-            if (!full_read(fs, &indirect_block, file_inode.data_ptrs[7])) {
+            if (!indirect_block) {
+              free(block_ptrs);
+              free(release_ids);
               return -1;
             }
             
@@ -662,32 +753,37 @@ int fs_remove(F16FS_t *fs, const char *path) {
             for (size_t i = 0; i < INDIRECT_TOTAL; i++) {
               if (!all_removed) {
                 if (indirect_block[i]) {
-                  block_store_release(fs->bs, indirect_block[i]);//check double indirect
+                  release_ids[release_count++] = indirect_block[i];//check double indirect
                 } 
                 else {
                   all_removed = true;
                 }
               }
             }
+            block_store_unmap_block(fs->bs, file_inode.data_ptrs[7], false);
           }
+
+          block_store_release_many(fs->bs, release_ids, release_count);
+          free(block_ptrs);
+          free(release_ids);
         }
                 
         memset(&file_inode, 0, sizeof(inode_t));//clear file inode
 
-        dir_block_t curr_parent_dir;
+        dir_block_t *curr_parent_dir;
                 
         if (write_inode(fs, &file_inode, file_status.inode)) {
-          if (full_read(fs, &curr_parent_dir, file_parent_inode.data_ptrs[0])) {
+          //remove dir_entry in place
+          if ((curr_parent_dir = (dir_block_t *) block_store_map_block_writable(fs->bs, file_parent_inode.data_ptrs[0]))) {
             for (size_t i = 0; i < DIR_REC_MAX; i++) {
-              if (file_status.inode == curr_parent_dir.entries[i].inode) {
-                curr_parent_dir.entries[i].fname[0] = '\0';
-                curr_parent_dir.entries[i].inode = 0;
-                curr_parent_dir.mdata.size--;//remove dir_entry
+              if (file_status.inode == curr_parent_dir->entries[i].inode) {
+                curr_parent_dir->entries[i].fname[0] = '\0';
+                curr_parent_dir->entries[i].inode = 0;
+                curr_parent_dir->mdata.size--;
               }
             }
-            if (full_write(fs, &curr_parent_dir, file_parent_inode.data_ptrs[0])) {
-              return 0;
-            }
+            block_store_unmap_block(fs->bs, file_parent_inode.data_ptrs[0], true);
+            return 0;
           } 
         } 
       } 